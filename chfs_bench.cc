@@ -0,0 +1,431 @@
+// Micro benchmarks of the chfs storage stack.
+//
+//   chfs_bench geometry [file-MB]
+//     sequential and random read/write throughput of the inode layer
+//     on a 512 byte and a 4 KB block disk
+//
+//   chfs_bench stat [files]
+//     extent RPCs per stat and per lookup, through an extent server
+//     in the same process, with the extent client cache off and on
+//
+//   chfs_bench parallel [threads...]
+//     write and read throughput of one chfs_client called from several
+//     threads, each on its own file, with the extent client cache off
+//
+//   chfs_bench stream [file-MB]
+//     sequential read throughput and extent RPCs of a file read in
+//     small requests, without and with read-ahead
+//
+//   chfs_bench copies [file-KB]
+//     times chfs_client copies the bytes of a read or a write in
+//     memory on their way between fuse and the extent RPCs
+
+#include "inode_manager.h"
+#include "extent_server.h"
+#include "chfs_client.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/time.h>
+#include <thread>
+
+#define IO_SIZE   (64*1024)   // sequential request size
+#define RAND_SIZE 4096        // random request size
+#define RAND_OPS  2000
+#define PAR_SIZE  (256*1024)  // file of each thread
+#define PAR_IO    4096        // request size
+
+static double
+now()
+{
+  struct timeval tv;
+  gettimeofday(&tv, NULL);
+  return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+static void
+report(const char *what, uint32_t bsize, uint64_t bytes, double secs)
+{
+  printf("  %-12s %5u B blocks: %8.1f MB/s\n", what, bsize,
+         bytes / secs / (1024*1024));
+}
+
+static void
+bench_geometry(uint32_t bsize, uint32_t file_mb)
+{
+  uint32_t file_size = file_mb << 20;
+  // room for the file and its indirect blocks
+  disk_geometry geo(bsize, 2*file_size + (4 << 20), INODE_NUM);
+  inode_manager im(NULL, geo);
+  uint32_t inum = im.alloc_inode(extent_protocol::T_FILE);
+  char *wbuf = (char *)malloc(IO_SIZE);
+  char *rbuf;
+  int rsize;
+  double t;
+
+  memset(wbuf, 'c', IO_SIZE);
+  t = now();
+  for (uint32_t off = 0; off < file_size; off += IO_SIZE)
+    im.write_file_range(inum, off, wbuf, IO_SIZE);
+  report("seq write", bsize, file_size, now() - t);
+
+  t = now();
+  for (uint32_t off = 0; off < file_size; off += IO_SIZE){
+    im.read_file_range(inum, off, IO_SIZE, &rbuf, &rsize);
+    free(rbuf);
+  }
+  report("seq read", bsize, file_size, now() - t);
+
+  srand(1);
+  t = now();
+  for (int i = 0; i < RAND_OPS; ++i){
+    uint32_t off = rand() % (file_size / RAND_SIZE) * RAND_SIZE;
+    im.write_file_range(inum, off, wbuf, RAND_SIZE);
+  }
+  report("rand write", bsize, (uint64_t)RAND_OPS * RAND_SIZE, now() - t);
+
+  t = now();
+  for (int i = 0; i < RAND_OPS; ++i){
+    uint32_t off = rand() % (file_size / RAND_SIZE) * RAND_SIZE;
+    im.read_file_range(inum, off, RAND_SIZE, &rbuf, &rsize);
+    free(rbuf);
+  }
+  report("rand read", bsize, (uint64_t)RAND_OPS * RAND_SIZE, now() - t);
+
+  free(wbuf);
+}
+
+static int
+bench_geometries(int argc, char *argv[])
+{
+  uint32_t file_mb = argc > 0 ? atoi(argv[0]) : 16;
+
+  if (file_mb == 0 || file_mb > 1024){
+    fprintf(stderr, "file size must be 1 to 1024 MB\n");
+    return 1;
+  }
+  printf("geometry: %u MB file, %u KB sequential and %u B random requests\n",
+         file_mb, IO_SIZE / 1024, RAND_SIZE);
+  bench_geometry(512, file_mb);
+  bench_geometry(4096, file_mb);
+  return 0;
+}
+
+static FILE *out = stdout;   // the extent server logs every call to stdout
+
+/* An extent server on a local port, serving every call. */
+static std::string
+start_extent_server(extent_server *es)
+{
+  int port = 20000 + getpid() % 10000;
+  rpcs *server = new rpcs(port);
+  server->reg(extent_protocol::get, es, &extent_server::get);
+  server->reg(extent_protocol::getattr, es, &extent_server::getattr);
+  server->reg(extent_protocol::put, es, &extent_server::put);
+  server->reg(extent_protocol::remove, es, &extent_server::remove);
+  server->reg(extent_protocol::create, es, &extent_server::create);
+  server->reg(extent_protocol::read, es, &extent_server::read);
+  server->reg(extent_protocol::write, es, &extent_server::write);
+  server->reg(extent_protocol::lookup, es, &extent_server::lookup);
+  server->reg(extent_protocol::add_entry, es, &extent_server::add_entry);
+  server->reg(extent_protocol::remove_entry, es, &extent_server::remove_entry);
+  server->reg(extent_protocol::create_entry, es, &extent_server::create_entry);
+  server->reg(extent_protocol::compound, es, &extent_server::compound);
+  server->reg(extent_protocol::readdir, es, &extent_server::readdir);
+  char buf[16];
+  snprintf(buf, sizeof(buf), "%d", port);
+  return buf;
+}
+
+/* The getattr of fuse.cc before the combined call. */
+static void
+old_getattr(chfs_client *fs, chfs_client::inum inum)
+{
+  chfs_client::fileinfo fin;
+  chfs_client::dirinfo din;
+
+  printf("getattr %016llx %d\n", inum, fs->isfile(inum));
+  if (fs->isfile(inum))
+    fs->getfile(inum, fin);
+  else if (fs->isdir(inum))
+    fs->getdir(inum, din);
+  else
+    fs->getfile(inum, fin);
+}
+
+static void
+bench_stat_client(const std::string &port, int lease_ms, int nfiles)
+{
+  chfs_client fs(port, lease_ms);
+  std::vector<chfs_client::inum> inums;
+  extent_protocol::attr a;
+  uint64_t calls;
+  char name[32];
+
+  for (int i = 0; i < nfiles; ++i){
+    chfs_client::inum inum;
+    snprintf(name, sizeof(name), "f%d-%d", lease_ms, i);
+    fs.create(1, name, 0644, inum);
+    inums.push_back(inum);
+  }
+  fprintf(out, "  lease %4d ms:", lease_ms);
+
+  // the first stat of each file, then a second one
+  for (int round = 0; round < 2; ++round){
+    calls = fs.rpc_count();
+    for (int i = 0; i < nfiles; ++i)
+      old_getattr(&fs, inums[i]);
+    fprintf(out, " old %.2f", (double)(fs.rpc_count() - calls) / nfiles);
+    calls = fs.rpc_count();
+    for (int i = 0; i < nfiles; ++i)
+      fs.getattr(inums[i], a);
+    fprintf(out, " getattr %.2f", (double)(fs.rpc_count() - calls) / nfiles);
+  }
+
+  calls = fs.rpc_count();
+  for (int i = 0; i < nfiles; ++i){
+    bool found;
+    chfs_client::inum inum;
+    snprintf(name, sizeof(name), "f%d-%d", lease_ms, i);
+    fs.lookup(1, name, found, inum);
+    fs.getattr(inum, a);
+  }
+  fprintf(out, " lookup+getattr %.2f\n", (double)(fs.rpc_count() - calls) / nfiles);
+}
+
+static int
+bench_stat(int argc, char *argv[])
+{
+  int nfiles = argc > 0 ? atoi(argv[0]) : 100;
+
+  if (nfiles <= 0 || nfiles >= INODE_NUM / 2){
+    fprintf(stderr, "files must be 1 to %d\n", INODE_NUM / 2 - 1);
+    return 1;
+  }
+  out = fdopen(dup(fileno(stdout)), "w");
+  setvbuf(out, NULL, _IONBF, 0);
+  if (freopen("/dev/null", "w", stdout) == NULL){
+    out = stdout;
+  }
+
+  extent_server es;
+  std::string port = start_extent_server(&es);
+  fprintf(out, "stat: extent RPCs per stat of %d files, first and second stat\n", nfiles);
+  bench_stat_client(port, 0, nfiles);
+  bench_stat_client(port, EXTENT_LEASE_MS, nfiles);
+  return 0;
+}
+
+static void
+par_write(chfs_client *fs, chfs_client::inum inum)
+{
+  std::string buf(PAR_IO, 'p');
+  size_t n;
+  for (uint32_t off = 0; off < PAR_SIZE; off += PAR_IO)
+    fs->write(inum, PAR_IO, off, buf.data(), n);
+  fs->flush(inum);
+}
+
+static void
+par_read(chfs_client *fs, chfs_client::inum inum)
+{
+  std::string buf;
+  for (uint32_t off = 0; off < PAR_SIZE; off += PAR_IO)
+    fs->read(inum, PAR_IO, off, buf);
+}
+
+static double
+par_run(chfs_client *fs, const std::vector<chfs_client::inum> &inums,
+        void (*fn)(chfs_client *, chfs_client::inum))
+{
+  std::vector<std::thread> threads;
+  double t = now();
+  for (size_t i = 0; i < inums.size(); ++i)
+    threads.push_back(std::thread(fn, fs, inums[i]));
+  for (size_t i = 0; i < threads.size(); ++i)
+    threads[i].join();
+  return (double)inums.size() * PAR_SIZE / (now() - t) / (1024*1024);
+}
+
+static int
+bench_parallel(int argc, char *argv[])
+{
+  std::vector<int> counts;
+  for (int i = 0; i < argc; ++i)
+    counts.push_back(atoi(argv[i]));
+  if (counts.empty()){
+    counts.push_back(1);
+    counts.push_back(2);
+    counts.push_back(4);
+    counts.push_back(8);
+  }
+  for (size_t i = 0; i < counts.size(); ++i){
+    if (counts[i] <= 0 || counts[i] > 64){
+      fprintf(stderr, "threads must be 1 to 64\n");
+      return 1;
+    }
+  }
+  out = fdopen(dup(fileno(stdout)), "w");
+  setvbuf(out, NULL, _IONBF, 0);
+  if (freopen("/dev/null", "w", stdout) == NULL){
+    out = stdout;
+  }
+
+  extent_server es;
+  std::string port = start_extent_server(&es);
+  chfs_client fs(port, 0);
+  fprintf(out, "parallel: %u KB file per thread, %u B requests\n",
+          PAR_SIZE / 1024, PAR_IO);
+  for (size_t i = 0; i < counts.size(); ++i){
+    std::vector<chfs_client::inum> inums(counts[i]);
+    char name[48];
+    for (int j = 0; j < counts[i]; ++j){
+      snprintf(name, sizeof(name), "p%zu-%d", i, j);
+      fs.create(1, name, 0644, inums[j]);
+    }
+    double w = par_run(&fs, inums, par_write);
+    double r = par_run(&fs, inums, par_read);
+    fprintf(out, "  %2d threads: write %8.1f MB/s  read %8.1f MB/s\n", counts[i], w, r);
+  }
+  return 0;
+}
+
+/* Read the file twice from start to end in PAR_IO requests. */
+static void
+bench_stream_client(const std::string &port, int lease_ms, uint32_t file_size)
+{
+  chfs_client fs(port, lease_ms);
+  chfs_client::inum inum;
+  std::string buf(PAR_IO, 's');
+  char name[32];
+  size_t n;
+
+  snprintf(name, sizeof(name), "s%d", lease_ms);
+  fs.create(1, name, 0644, inum);
+  for (uint32_t off = 0; off < file_size; off += PAR_IO)
+    fs.write(inum, PAR_IO, off, buf.data(), n);
+  fs.release(inum);
+  fprintf(out, "  lease %4d ms:", lease_ms);
+  for (int round = 0; round < 2; ++round){
+    uint64_t calls = fs.rpc_count();
+    double t = now();
+    for (uint32_t off = 0; off < file_size; off += PAR_IO)
+      fs.read(inum, PAR_IO, off, buf);
+    t = now() - t;
+    fs.release(inum);
+    fprintf(out, " %8.1f MB/s %5.1f RPCs/MB", file_size / t / (1024*1024),
+            (double)(fs.rpc_count() - calls) / (file_size >> 20));
+  }
+  fprintf(out, "\n");
+}
+
+static int
+bench_stream(int argc, char *argv[])
+{
+  uint32_t file_mb = argc > 0 ? atoi(argv[0]) : 4;
+
+  if (file_mb == 0 || file_mb > 8){
+    fprintf(stderr, "file size must be 1 to 8 MB\n");
+    return 1;
+  }
+  out = fdopen(dup(fileno(stdout)), "w");
+  setvbuf(out, NULL, _IONBF, 0);
+  if (freopen("/dev/null", "w", stdout) == NULL){
+    out = stdout;
+  }
+
+  extent_server es;
+  std::string port = start_extent_server(&es);
+  fprintf(out, "stream: %u MB file read twice in %u B requests\n", file_mb, PAR_IO);
+  bench_stream_client(port, 0, file_mb << 20);
+  bench_stream_client(port, EXTENT_LEASE_MS, file_mb << 20);
+  return 0;
+}
+
+static void
+report_copies(const char *what, chfs_client *fs, uint64_t before, uint64_t bytes)
+{
+  fprintf(out, "  %-22s %.2f copies/byte\n", what,
+          (double)(fs->copy_count() - before) / bytes);
+}
+
+/* Write the file in PAR_IO pieces, read it back twice, and write it
+ * again. */
+static void
+bench_copies_client(const std::string &port, int lease_ms, uint32_t file_size)
+{
+  chfs_client fs(port, lease_ms);
+  chfs_client::inum inum;
+  std::string wbuf(PAR_IO, 'c'), rbuf;
+  char name[32];
+  size_t n;
+  uint64_t c;
+
+  snprintf(name, sizeof(name), "c%d", lease_ms);
+  fs.create(1, name, 0644, inum);
+  fprintf(out, " lease %d ms, %u KB file\n", lease_ms, file_size / 1024);
+  c = fs.copy_count();
+  for (uint32_t off = 0; off < file_size; off += PAR_IO)
+    fs.write(inum, PAR_IO, off, wbuf.data(), n);
+  fs.flush(inum);
+  report_copies("write", &fs, c, file_size);
+  for (int round = 0; round < 2; ++round){
+    c = fs.copy_count();
+    for (uint32_t off = 0; off < file_size; off += PAR_IO)
+      fs.read(inum, PAR_IO, off, rbuf);
+    report_copies(round ? "read again" : "read", &fs, c, file_size);
+  }
+  // with a lease the file is cached now, and the writes go to the cache
+  c = fs.copy_count();
+  for (uint32_t off = 0; off < file_size; off += PAR_IO)
+    fs.write(inum, PAR_IO, off, wbuf.data(), n);
+  fs.flush(inum);
+  report_copies("write again", &fs, c, file_size);
+}
+
+static int
+bench_copies(int argc, char *argv[])
+{
+  uint32_t file_kb = argc > 0 ? atoi(argv[0]) : 32;
+
+  if (file_kb == 0 || file_kb > 1024){
+    fprintf(stderr, "file size must be 1 to 1024 KB\n");
+    return 1;
+  }
+  out = fdopen(dup(fileno(stdout)), "w");
+  setvbuf(out, NULL, _IONBF, 0);
+  if (freopen("/dev/null", "w", stdout) == NULL){
+    out = stdout;
+  }
+
+  extent_server es;
+  std::string port = start_extent_server(&es);
+  fprintf(out, "copies: in-memory copies of each file byte, %u B requests\n", PAR_IO);
+  bench_copies_client(port, 0, file_kb * 1024);
+  bench_copies_client(port, EXTENT_LEASE_MS, file_kb * 1024);
+  return 0;
+}
+
+int
+main(int argc, char *argv[])
+{
+  setvbuf(stdout, NULL, _IONBF, 0);
+  if (argc >= 2 && strcmp(argv[1], "geometry") == 0)
+    return bench_geometries(argc - 2, argv + 2);
+  if (argc >= 2 && strcmp(argv[1], "stat") == 0)
+    return bench_stat(argc - 2, argv + 2);
+  if (argc >= 2 && strcmp(argv[1], "parallel") == 0)
+    return bench_parallel(argc - 2, argv + 2);
+  if (argc >= 2 && strcmp(argv[1], "stream") == 0)
+    return bench_stream(argc - 2, argv + 2);
+  if (argc >= 2 && strcmp(argv[1], "copies") == 0)
+    return bench_copies(argc - 2, argv + 2);
+
+  fprintf(stderr, "Usage: %s geometry [file-MB]\n"
+                  "       %s stat [files]\n"
+                  "       %s parallel [threads...]\n"
+                  "       %s stream [file-MB]\n"
+                  "       %s copies [file-KB]\n", argv[0], argv[0], argv[0], argv[0], argv[0]);
+  return 1;
+}
@@ -3,6 +3,7 @@
 #include "extent_client.h"
 #include <sstream>
 #include <iostream>
+#include <stdint.h>
 #include <stdio.h>
 #include <unistd.h>
 #include <sys/types.h>
@@ -10,11 +11,284 @@
 #include <fcntl.h>
 
 
-chfs_client::chfs_client(std::string extent_dst)
+chfs_client::chfs_client(std::string extent_dst, int lease_ms)
+    : stopping(false), copied(0), ra_stop(false), ra_lease(lease_ms)
 {
-    ec = new extent_client(extent_dst);
-    if (ec->put(1, "") != extent_protocol::OK)
+    ec = new extent_client(extent_dst, lease_ms);
+    // the extent server creates the root dir; it may already hold
+    // entries when the server runs on a disk image
+    extent_protocol::attr a;
+    if (ec->getattr(1, a) != extent_protocol::OK || a.type != extent_protocol::T_DIR)
         printf("error init root dir\n"); // XYB: init root dir
+    flusher = std::thread(&chfs_client::flush_loop, this);
+    for (int i = 0; ra_lease.count() > 0 && i < CHFS_RA_THREADS; ++i)
+        prefetchers.push_back(std::thread(&chfs_client::read_ahead_loop, this));
+}
+
+chfs_client::~chfs_client()
+{
+    {
+        std::lock_guard<std::mutex> lock(ra_mtx);
+        ra_stop = true;
+    }
+    ra_cv.notify_all();
+    for (size_t i = 0; i < prefetchers.size(); ++i)
+        prefetchers[i].join();
+    {
+        std::lock_guard<std::mutex> lock(wbuf_mtx);
+        stopping = true;
+    }
+    wbuf_cv.notify_all();
+    flusher.join();   // writes back what is still buffered
+    delete ec;
+}
+
+bool
+chfs_client::buffered(inum ino)
+{
+    std::lock_guard<std::mutex> lock(wbuf_mtx);
+    return wbufs.find(ino) != wbufs.end();
+}
+
+/* Hand the buffered writes to ino to the extent client. The caller
+ * holds the lock of ino, so nobody else changes the buffer, which stays
+ * in wbufs until the write succeeds; after a failure the flusher tries
+ * again a delay later. */
+int
+chfs_client::flush_buffer(inum ino)
+{
+    write_buffer *b;
+    {
+        std::lock_guard<std::mutex> lock(wbuf_mtx);
+        std::map<inum, write_buffer>::iterator it = wbufs.find(ino);
+        if (it == wbufs.end())
+            return OK;
+        b = &it->second;
+    }
+    if (ec->write(ino, b->off, b->data.data(), b->data.size()) != extent_protocol::OK) {
+        std::lock_guard<std::mutex> lock(wbuf_mtx);
+        b->since = std::chrono::steady_clock::now();
+        return IOERR;
+    }
+    std::lock_guard<std::mutex> lock(wbuf_mtx);
+    wbufs.erase(ino);
+    return OK;
+}
+
+/* Forget the buffered writes to ino and what was read ahead of it, as
+ * it is removed. The caller holds the lock of ino. */
+void
+chfs_client::drop_buffer(inum ino)
+{
+    forget_stream(ino, true);
+    std::lock_guard<std::mutex> lock(wbuf_mtx);
+    wbufs.erase(ino);
+}
+
+/* The size and times of ino with its buffered writes. */
+void
+chfs_client::buffered_attr(inum ino, extent_protocol::attr &a)
+{
+    std::lock_guard<std::mutex> lock(wbuf_mtx);
+    std::map<inum, write_buffer>::iterator it = wbufs.find(ino);
+    if (it == wbufs.end())
+        return;
+    unsigned long long end = it->second.off + it->second.data.size();
+    if (end > a.size)
+        a.size = end;
+    a.mtime = a.ctime = it->second.mtime;
+}
+
+/* The read-ahead state of ino, NULL if there is none. The caller holds
+ * ra_mtx. */
+chfs_client::read_stream *
+chfs_client::find_stream(inum ino)
+{
+    std::map<inum, read_stream>::iterator it = streams.find(ino);
+    return it == streams.end() ? NULL : &it->second;
+}
+
+/* Serve a read of ino from what was read ahead if it can be, and keep
+ * a window ahead of a sequential reader; false leaves the read to the
+ * caller. */
+bool
+chfs_client::read_ahead(inum ino, unsigned long long off, size_t size,
+                        std::string &data)
+{
+    // the extent client holds the whole of a small file
+    if (ra_lease.count() == 0 || ec->cached(ino))
+        return false;
+    std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+    std::unique_lock<std::mutex> lock(ra_mtx);
+    read_stream *st = find_stream(ino);
+    if (st == NULL) {
+        if (streams.size() >= CHFS_RA_STREAMS) {
+            // the stream read longest ago makes room, unless it is fetching
+            std::map<inum, read_stream>::iterator it, lru = streams.end();
+            for (it = streams.begin(); it != streams.end(); ++it) {
+                if (!it->second.fetching
+                    && (lru == streams.end() || it->second.used < lru->second.used))
+                    lru = it;
+            }
+            if (lru == streams.end())
+                return false;
+            streams.erase(lru);
+        }
+        st = &streams[ino];
+        st->window = 0;
+        st->off = 0;
+        st->eof = false;
+        st->fetching = false;
+        st->fetch_off = 0;
+        st->fetch_len = 0;
+        st->gen = 0;
+        st->next = off + size;
+        st->used = st->fetched = now;
+        return false;
+    }
+    st->used = now;
+    if (off != st->next) {
+        st->next = off + size;
+        st->window = 0;
+        st->data.clear();
+        st->eof = false;
+        st->gen++;
+        return false;
+    }
+    st->next = off + size;
+
+    // the fetch of what is read now is on its way
+    while (st->fetching && off >= st->fetch_off && off < st->fetch_off + st->fetch_len) {
+        ra_done.wait(lock);
+        if ((st = find_stream(ino)) == NULL)
+            return false;
+    }
+    if (now - st->fetched > ra_lease) {
+        st->data.clear();
+        st->eof = false;
+    }
+    unsigned long long end = st->off + st->data.size();
+    bool hit = (!st->data.empty() || st->eof) && off >= st->off
+        && (off + size <= end || st->eof);
+    if (hit) {
+        if (off < end)
+            data.assign(st->data, off - st->off, size);
+        else
+            data.clear();
+        copied += data.size();
+        // drop what has been read once it is half the buffer
+        size_t done = off + data.size() - st->off;
+        if (done > st->data.size() / 2) {
+            st->data.erase(0, done);
+            st->off += done;
+        }
+    }
+    if (!st->fetching && !st->eof) {
+        if (!hit)
+            start_fetch(ino, *st, off + size);
+        else if (end - (off + data.size()) < st->window / 2 + 1)
+            start_fetch(ino, *st, end);
+    }
+    return hit;
+}
+
+/* Queue the fetch of the next window of st from off. */
+void
+chfs_client::start_fetch(inum ino, read_stream &st, unsigned long long off)
+{
+    st.window = st.window ? std::min(st.window * 2, (unsigned int)CHFS_RA_MAX) : CHFS_RA_MIN;
+    st.fetching = true;
+    st.fetch_off = off;
+    st.fetch_len = st.window;
+    ra_queue.push_back(ino);
+    ra_cv.notify_one();
+}
+
+/* What was read ahead of ino is out of date; with all, ino is done
+ * with. */
+void
+chfs_client::forget_stream(inum ino, bool all)
+{
+    std::lock_guard<std::mutex> lock(ra_mtx);
+    read_stream *st = find_stream(ino);
+    if (st == NULL)
+        return;
+    if (all && !st->fetching) {
+        streams.erase(ino);
+        return;
+    }
+    st->gen++;
+    st->data.clear();
+    st->eof = false;
+}
+
+/* A read-ahead thread: fetch the windows start_fetch queues. A fetch a
+ * change of the file overtook is dropped. */
+void
+chfs_client::read_ahead_loop()
+{
+    std::unique_lock<std::mutex> lock(ra_mtx);
+    while (true) {
+        ra_cv.wait(lock, [this] { return ra_stop || !ra_queue.empty(); });
+        if (ra_stop)
+            return;
+        inum ino = ra_queue.front();
+        ra_queue.pop_front();
+        read_stream *st = find_stream(ino);
+        if (st == NULL || !st->fetching)
+            continue;
+        unsigned long long off = st->fetch_off;
+        unsigned int len = st->fetch_len;
+        uint64_t gen = st->gen;
+        std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+        lock.unlock();
+        std::string buf;
+        extent_protocol::status r = ec->read(ino, off, len, buf);
+        lock.lock();
+        if ((st = find_stream(ino)) == NULL)
+            continue;
+        st->fetching = false;
+        if (r == extent_protocol::OK && st->gen == gen) {
+            st->eof = buf.size() < len;
+            if (!st->data.empty() && off == st->off + st->data.size()) {
+                st->data.append(buf);
+                copied += buf.size();
+            } else {
+                st->off = off;
+                st->data.swap(buf);
+                st->fetched = start;
+            }
+        }
+        ra_done.notify_all();
+    }
+}
+
+/* Write back the buffers that are CHFS_WRITE_DELAY_MS old, and all of
+ * them when the client goes away. */
+void
+chfs_client::flush_loop()
+{
+    std::chrono::milliseconds delay(CHFS_WRITE_DELAY_MS);
+    std::unique_lock<std::mutex> lock(wbuf_mtx);
+    while (true) {
+        bool stop = stopping;
+        std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+        std::vector<inum> due;
+        std::map<inum, write_buffer>::iterator it;
+        for (it = wbufs.begin(); it != wbufs.end(); ++it) {
+            if (stop || now - it->second.since >= delay)
+                due.push_back(it->first);
+        }
+        lock.unlock();
+        for (size_t i = 0; i < due.size(); ++i) {
+            std::lock_guard<std::mutex> ilock(ino_lock(due[i]));
+            flush_buffer(due[i]);
+        }
+        lock.lock();
+        if (stop)
+            return;
+        wbuf_cv.wait_for(lock, delay / 2, [this] { return stopping; });
+    }
 }
 
 chfs_client::inum
@@ -86,6 +360,21 @@ chfs_client::issymlink(inum inum)
     return false;
 }
 
+/* Type, size and times in one call, for a stat. */
+int
+chfs_client::getattr(inum inum, extent_protocol::attr &a)
+{
+    // a write back in progress is waited for
+    std::unique_lock<std::mutex> lock(ino_lock(inum), std::defer_lock);
+    if (buffered(inum))
+        lock.lock();
+    if (ec->getattr(inum, a) != extent_protocol::OK || a.type == 0) {
+        return IOERR;
+    }
+    buffered_attr(inum, a);
+    return OK;
+}
+
 int
 chfs_client::getfile(inum inum, fileinfo &fin)
 {
@@ -97,6 +386,7 @@ chfs_client::getfile(inum inum, fileinfo &fin)
         r = IOERR;
         goto release;
     }
+    buffered_attr(inum, a);
 
     fin.atime = a.atime;
     fin.mtime = a.mtime;
@@ -147,7 +437,12 @@ chfs_client::setattr(inum ino, size_t size)
      * note: get the content of inode ino, and modify its content
      * according to the size (<, =, or >) content length.
      */
+    std::lock_guard<std::mutex> lock(ino_lock(ino));
     std::string buf;
+    forget_stream(ino, false);
+    if (flush_buffer(ino) != OK) {
+        return IOERR;
+    }
     if (ec->get(ino, buf)!=extent_protocol::OK){
         return IOERR;
     }
@@ -162,143 +457,96 @@ chfs_client::setattr(inum ino, size_t size)
 int
 chfs_client::create(inum parent, const char *name, mode_t mode, inum &ino_out)
 {
-    int r = OK;
-
     /*
-     * your code goes here.
-     * note: lookup is what you need to check if file exist;
-     * after create file or dir, you must remember to modify the parent infomation.
+     * the extent server checks the name, creates the file and links it
+     * into parent in one call, see extent_server::create_entry.
      */
-    
-    // check if file has existed
-    bool found = false;
-    inum tmp;  // not necessary
-    if (lookup(parent, name, found, tmp)!=extent_protocol::OK){
-        return IOERR;
-    }
-    if (found == false) {
-        ec->create(extent_protocol::T_FILE, ino_out);
-
-        std::string buf;
-        if (ec->get(parent, buf)!=extent_protocol::OK){
-            return IOERR;
-        }
-        buf.append(std::string(name) + ":" + filename(ino_out) + "/");
-        if (ec->put(parent, buf)!=extent_protocol::OK){
-            return IOERR;
-        }
-        return r;
-    }
-    else{
-        return EXIST;
-    }
-
-
+    return create_entry(parent, extent_protocol::T_FILE, name, "", ino_out);
 }
 
 int
 chfs_client::mkdir(inum parent, const char *name, mode_t mode, inum &ino_out)
+{
+    return create_entry(parent, extent_protocol::T_DIR, name, "", ino_out);
+}
+
+int
+chfs_client::lookup(inum parent, const char *name, bool &found, inum &ino_out)
 {
     int r = OK;
 
     /*
-     * your code goes here.
-     * note: lookup is what you need to check if directory exist;
-     * after create file or dir, you must remember to modify the parent infomation.
+     * the extent server reads only the blocks of the name's
+     * hash bucket, see directory.h for the format.
      */
-
-    // check if dir name has existed
-    bool found = false;
-    inum tmp;  // not necessary
-    if (lookup(parent, name, found, tmp)!=extent_protocol::OK){
+    switch (ec->lookup(parent, name, ino_out)) {
+    case extent_protocol::OK:
+        found = true;
+        return r;
+    case extent_protocol::NOENT:
+        found = false;
+        return r;
+    default:
         return IOERR;
     }
-    if (found == false) {
-        ec->create(extent_protocol::T_DIR, ino_out);
+}
 
-        std::string buf;
-        if (ec->get(parent, buf)!=extent_protocol::OK){
-            return IOERR;
-        }
-        buf.append(std::string(name) + ":" + filename(ino_out) + "/");
-        if (ec->put(parent, buf)!=extent_protocol::OK){
-            return IOERR;
-        }
-        return r;
-    }
-    else{
+/* Create a file of type holding data and link it into parent. */
+int
+chfs_client::create_entry(inum parent, uint32_t type, const char *name,
+                          const std::string &data, inum &ino_out)
+{
+    switch (ec->create_entry(parent, type, name, data, ino_out)) {
+    case extent_protocol::OK:
+        return OK;
+    case extent_protocol::EXIST:
         return EXIST;
+    default:
+        return IOERR;
     }
 }
 
 int
-chfs_client::lookup(inum parent, const char *name, bool &found, inum &ino_out)
+chfs_client::readdir(inum dir, std::list<dirent> &list)
 {
     int r = OK;
 
     /*
-     * your code goes here.
-     * note: lookup file from parent dir according to name;
-     * you should design the format of directory content.
+     * batch after batch, each going on from the cookie of the
+     * last entry of the one before.
      */
-    std::list<dirent> list;
-    if (readdir(parent, list)!=extent_protocol::OK){
-        return IOERR;
+    unsigned long long cookie = 0;
+    while (true) {
+        size_t n = list.size();
+        if ((r = readdir(dir, cookie, CHFS_READDIR_BATCH, list)) != OK)
+            return r;
+        if (list.size() - n < CHFS_READDIR_BATCH)
+            break;
+        cookie = list.back().cookie;
     }
 
-    if (!list.empty()) {
-        for (std::list<dirent>::iterator it = list.begin(); it != list.end(); it++) {
-            if (it->name.compare(name) == 0) {
-                // exist
-                found = true;
-                ino_out = it->inum;
-                return r;
-            }
-        } 
-    }
-    found = false;
     return r;
 }
 
+/* Up to about max entries of dir from cookie on, appended to list;
+ * fewer means the end. The extent client keeps their attributes. */
 int
-chfs_client::readdir(inum dir, std::list<dirent> &list)
+chfs_client::readdir(inum dir, unsigned long long cookie, size_t max,
+                     std::list<dirent> &list)
 {
-    int r = OK;
-
-    /*
-     * your code goes here.
-     * note: you should parse the dirctory content using your defined format,
-     * and push the dirents to the list.
-     */
-    // my format of dir content: "name:inum/name:inum/name:inum/"
-
-    // get directory content
-    std::string buf;
-    if (ec->get(dir, buf)!=extent_protocol::OK){
+    std::vector<extent_protocol::dirent> entries;
+    if (ec->readdir(dir, cookie, max, entries) != extent_protocol::OK) {
         return IOERR;
     }
-
-    // traverse directory content
-    
-    int start = 0;
-    int end = buf.find(':');
-    while (end != std::string::npos) {
-        std::string name = buf.substr(start, end - start);
-        start = end + 1;
-        end = buf.find('/', start);
-        std::string inum = buf.substr(start, end - start);
-            
+    for (size_t i = 0; i < entries.size(); ++i) {
         struct dirent entry;
-        entry.name = name;
-        entry.inum = n2i(inum);
-
+        entry.name = entries[i].name;
+        entry.inum = entries[i].id;
+        entry.type = entries[i].a.type;
+        entry.cookie = entries[i].cookie;
         list.push_back(entry);
-        
-        start = end + 1;
-        end = buf.find(':', start);
     }
-
-    return r;
+    return OK;
 }
 
 int
@@ -307,24 +555,23 @@ chfs_client::read(inum ino, size_t size, off_t off, std::string &data)
     int r = OK;
 
     /*
-     * your code goes here.
-     * note: read using ec->get().
+     * only the requested range travels over the wire;
+     * the extent server clips it against the file size.
      */
-    std::string buf;
-    if (ec->get(ino, buf)!=extent_protocol::OK){
+    if (off < 0){
         return IOERR;
     }
-
-    int fileSize = buf.size();
-    int end = off + size; 
-    if (fileSize < end){
-        data = buf.substr(off);
+    if (buffered(ino)) {
+        std::lock_guard<std::mutex> lock(ino_lock(ino));
+        if (flush_buffer(ino) != OK) {
+            return IOERR;
+        }
     }
-    else if (fileSize < off){
-        data = "";
+    if (read_ahead(ino, off, size, data)) {
+        return r;
     }
-    else{
-        data = buf.substr(off, size);
+    if (ec->read(ino, off, size, data)!=extent_protocol::OK){
+        return IOERR;
     }
     return r;  
 }
@@ -336,102 +583,122 @@ chfs_client::write(inum ino, size_t size, off_t off, const char *data,
     int r = OK;
 
     /*
-     * your code goes here.
-     * note: write using ec->put().
-     * when off > length of original file, fill the holes with '\0'.
+     * only the written bytes are shipped; the extent server
+     * fills the hole with '\0' when off > length of original file.
+     * A write that follows on from the buffered ones joins them.
      */
-    
-    std::string buf;
-    if (ec->get(ino, buf)!=extent_protocol::OK){
+    if (off < 0){
         return IOERR;
     }
-    
-    int fileSize = buf.size();
-    int end = off+size;
-    // off + write size <= file size
-    if (end <= fileSize) {
-        for (int i=0; i<size; ++i){
-            buf[off+i] = data[i];
-        }
-        bytes_written = size;
-        ec->put(ino, buf);
-        return r;
-    }
-
-    // off + write size > file size
-    buf.resize(end);
-    for (int i=0;i<size;++i){
-        buf[off+i] = data[i];
+    // extents are addressed with 32 bit offsets; refuse here what the
+    // server would refuse only when the buffer is written back
+    if ((unsigned long long)off + size > UINT32_MAX){
+        return IOERR;
     }
-    bytes_written = size;
-    if (ec->put(ino, buf)!=extent_protocol::OK){
+    std::lock_guard<std::mutex> lock(ino_lock(ino));
+    forget_stream(ino, false);
+    std::unique_lock<std::mutex> wlock(wbuf_mtx);
+    std::map<inum, write_buffer>::iterator it = wbufs.find(ino);
+    if (it != wbufs.end() && ((unsigned long long)off < it->second.off
+            || (unsigned long long)off > it->second.off + it->second.data.size())) {
+        wlock.unlock();
+        if (flush_buffer(ino) != OK) {
+            return IOERR;
+        }
+        wlock.lock();
+        it = wbufs.end();
+    }
+    if (it == wbufs.end()) {
+        wlock.unlock();
+        if (size >= CHFS_WRITE_BUFFER || ec->cached(ino)) {
+            if (ec->write(ino, off, data, size)!=extent_protocol::OK){
+                return IOERR;
+            }
+            bytes_written = size;
+            return r;
+        }
+        wlock.lock();
+        it = wbufs.insert(std::make_pair(ino, write_buffer())).first;
+        it->second.off = off;
+        it->second.since = std::chrono::steady_clock::now();
+    }
+    write_buffer &b = it->second;
+    b.data.replace(off - b.off, size, data, size);
+    b.mtime = time(NULL);
+    copied += size;
+    bool full = b.data.size() >= CHFS_WRITE_BUFFER;
+    wlock.unlock();
+    if (full && flush_buffer(ino) != OK) {
         return IOERR;
     }
+    bytes_written = size;
     return r;
 }
 
-int chfs_client::unlink(inum parent,const char *name)
+/* Write back what chfs_client buffered and the extent client cached
+ * of ino. */
+int
+chfs_client::flush(inum ino)
 {
-    int r = OK;
-
-    /*
-     * your code goes here.
-     * note: you should remove the file using ec->remove,
-     * and update the parent directory content.
-     */
-    bool found = false;
-    inum inum;
-    if (lookup(parent, name, found, inum)!=extent_protocol::OK){
-        return IOERR;
-    }
-    if (ec->remove(inum)!=extent_protocol::OK){
+    std::lock_guard<std::mutex> lock(ino_lock(ino));
+    if (flush_buffer(ino) != OK) {
         return IOERR;
     }
-
-    std::string buf;
-    if (ec->get(parent, buf)!=extent_protocol::OK){
+    if (ec->flush(ino) != extent_protocol::OK) {
         return IOERR;
     }
-    int erase_start = buf.find(name);
-    int erase_after = buf.find('/', erase_start);
-    buf.erase(erase_start, erase_after-erase_start+1);
-    if (ec->put(parent, buf)!=extent_protocol::OK){
-        return IOERR;
-    }
-    
-    return r;
+    return OK;
 }
 
-int chfs_client::symlink(inum parent, const char* name, const char* link, inum &ino_out)
+/* Like flush, at the last close; ino is not read ahead any more. */
+int
+chfs_client::release(inum ino)
 {
-	int r = OK;
+    forget_stream(ino, true);
+    return flush(ino);
+}
 
-/* check if symlink name has existed */
-	bool found = false;
-	inum tmp;
-    if (lookup(parent, name, found, tmp)!=extent_protocol::OK){
-        return EXIST;
-    }
-	if (found) return EXIST;
-	/* pick an inum and init the symlink */
-    if (ec->create(extent_protocol::T_SYMLINK, ino_out)!=extent_protocol::OK){
+int chfs_client::unlink(inum parent,const char *name)
+{
+    /*
+     * the extent server removes the entry and the file it
+     * named together. The writes buffered for the file are
+     * dropped once it is gone, still under its lock: the flusher
+     * must not write them to the freed inum, which a new file may
+     * get, and a failed removal must not lose them.
+     */
+    inum ino, removed;
+    switch (ec->lookup(parent, name, ino)) {
+    case extent_protocol::OK:
+        break;
+    case extent_protocol::NOENT:
+        return NOENT;
+    default:
         return IOERR;
     }
-    if (ec->put(ino_out, std::string(link))!=extent_protocol::OK){
+    std::unique_lock<std::mutex> lock(ino_lock(ino));
+    switch (ec->remove_entry(parent, name, removed)) {
+    case extent_protocol::OK:
+        if (removed != ino && &ino_lock(removed) != &ino_lock(ino)) {
+            // the name went to another file since the lookup; ino
+            // stays, so its lock goes before the other one is taken,
+            // and no thread ever holds two
+            lock.unlock();
+            lock = std::unique_lock<std::mutex>(ino_lock(removed));
+        }
+        drop_buffer(removed);
+        return OK;
+    case extent_protocol::NOENT:
+        return NOENT;
+    default:
         return IOERR;
     }
+}
 
-	
-	/* add an entry into parent */
-   std::string buf;
-   if (ec->get(parent, buf)!=extent_protocol::OK){
-      return IOERR;
-   }
-   buf.append(std::string(name) + ":" + filename(ino_out) + "/");
-   if (ec->put(parent, buf)!=extent_protocol::OK){
-    return IOERR;
-   }
-   return r;
+int chfs_client::symlink(inum parent, const char* name, const char* link, inum &ino_out)
+{
+    /* the target is the initial contents of the symlink */
+    return create_entry(parent, extent_protocol::T_SYMLINK, name, link, ino_out);
 }
 
 int chfs_client::readlink(inum ino, std::string &data)
@@ -5,10 +5,84 @@
 //#include "chfs_protocol.h"
 #include "extent_client.h"
 #include <vector>
+#include <map>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <thread>
+
+// fuse may call from several threads at once. The extent client keeps
+// its own cache consistent; a change that reads the file before
+// writing it, and the write buffer of a file, go under the lock of the
+// file's stripe.
+#define CHFS_INODE_LOCKS 64
+
+// Writes to a file that run on from each other are gathered into one
+// buffer, handed to the extent client as a single write when the next
+// one does not follow on, when the buffer holds CHFS_WRITE_BUFFER
+// bytes, on flush, fsync and release, or CHFS_WRITE_DELAY_MS after the
+// first write. getattr counts the buffered writes in; read, setattr
+// and flush write them back first. A write as large as the buffer, or
+// to a file the extent client caches the contents of, goes straight to
+// the extent client, which gathers writes to what it caches itself.
+#define CHFS_WRITE_BUFFER (256*1024)
+#define CHFS_WRITE_DELAY_MS 500
+
+// A file read from where the last read of it ended is read ahead: the
+// next window is fetched by a read-ahead thread while the reader takes
+// what came before. The window starts at CHFS_RA_MIN bytes and doubles
+// with each fetch up to CHFS_RA_MAX; a read elsewhere in the file
+// stops read-ahead until reads run on again. What is read ahead is
+// kept no longer than the extent client keeps what it caches, so there
+// is no read-ahead without an extent cache lease.
+#define CHFS_RA_MIN (64*1024)
+#define CHFS_RA_MAX (1024*1024)
+#define CHFS_RA_STREAMS 64   // files read ahead at once
+#define CHFS_RA_THREADS 4
+
+// entries fetched per extent call when a whole directory is listed
+#define CHFS_READDIR_BATCH 256
 
 
 class chfs_client {
   extent_client *ec;
+  std::mutex ino_locks[CHFS_INODE_LOCKS];
+
+  struct write_buffer {
+    unsigned long long off;
+    std::string data;
+    time_t mtime;
+    std::chrono::steady_clock::time_point since;
+  };
+  std::map<unsigned long long, write_buffer> wbufs;
+  std::mutex wbuf_mtx;        // guards wbufs and stopping
+  std::condition_variable wbuf_cv;
+  bool stopping;
+  std::thread flusher;
+  std::atomic<uint64_t> copied;
+
+  struct read_stream {
+    unsigned long long next;       // where a sequential read starts
+    unsigned int window;           // 0 while reads are not sequential
+    unsigned long long off;        // of data
+    std::string data;              // read ahead
+    bool eof;                      // the file ends where data does
+    std::chrono::steady_clock::time_point fetched, used;
+    bool fetching;
+    unsigned long long fetch_off;
+    unsigned int fetch_len;
+    uint64_t gen;                  // a change of the file bumps it
+  };
+  std::map<unsigned long long, read_stream> streams;
+  std::deque<unsigned long long> ra_queue;
+  std::mutex ra_mtx;          // guards streams, ra_queue and ra_stop
+  std::condition_variable ra_cv;      // for the read-ahead threads
+  std::condition_variable ra_done;    // for readers waiting on a fetch
+  bool ra_stop;
+  std::vector<std::thread> prefetchers;
+  std::chrono::milliseconds ra_lease;
  public:
 
   typedef unsigned long long inum;
@@ -29,6 +103,8 @@ class chfs_client {
   struct dirent {
     std::string name;
     chfs_client::inum inum;
+    uint32_t type;               // extent_protocol::types
+    unsigned long long cookie;   // readdir from here goes on after it
   };
   struct syminfo {
     std::string slink;
@@ -41,14 +117,30 @@ class chfs_client {
  private:
   static std::string filename(inum);
   static inum n2i(std::string);
+  std::mutex &ino_lock(inum ino) { return ino_locks[ino % CHFS_INODE_LOCKS]; }
+  bool buffered(inum);
+  int flush_buffer(inum);
+  void drop_buffer(inum);
+  void buffered_attr(inum, extent_protocol::attr &);
+  void flush_loop();
+  read_stream *find_stream(unsigned long long ino);
+  bool read_ahead(unsigned long long ino, unsigned long long off, size_t size,
+                  std::string &data);
+  void start_fetch(unsigned long long ino, read_stream &st, unsigned long long off);
+  void forget_stream(unsigned long long ino, bool all);
+  void read_ahead_loop();
+  int create_entry(inum parent, uint32_t type, const char *name,
+                   const std::string &data, inum &ino_out);
 
  public:
-  chfs_client(std::string);
+  chfs_client(std::string, int lease_ms = EXTENT_LEASE_MS);
+  ~chfs_client();
 
   bool isfile(inum);
   bool isdir(inum);
   bool issymlink(inum);
 
+  int getattr(inum, extent_protocol::attr &);
   int getfile(inum, fileinfo &);
   int getdir(inum, dirinfo &);
   int getsymlink(inum, syminfo&);
@@ -57,10 +149,16 @@ class chfs_client {
   int lookup(inum, const char *, bool &, inum &);
   int create(inum, const char *, mode_t, inum &);
   int readdir(inum, std::list<dirent> &);
+  int readdir(inum, unsigned long long cookie, size_t max, std::list<dirent> &);
   int write(inum, size_t, off_t, const char *, size_t &);
   int read(inum, size_t, off_t, std::string &);
   int unlink(inum,const char *);
   int mkdir(inum , const char *, mode_t , inum &);
+  int flush(inum);
+  int release(inum);
+  uint64_t rpc_count() const { return ec->calls; }
+  uint64_t copy_count() const { return ec->copied + copied; }
+  void set_watcher(extent_watcher *w) { ec->set_watcher(w); }
   
   /** you may need to add symbolic link related methods here.*/
   int symlink(inum parent, const char* name, const char* link, inum &ino_out);
@@ -5,12 +5,15 @@ chfs_command_raft::chfs_command_raft() {
     this->cmd_tp = CMD_NONE;
     this->type = 0;
     this->id = 0;
+    this->off = 0;
+    this->len = 0;
     this->buf = "";
+    this->name = "";
     this->res = std::make_shared<result>();
 }
 
 chfs_command_raft::chfs_command_raft(const chfs_command_raft &cmd) :
-    cmd_tp(cmd.cmd_tp), type(cmd.type),  id(cmd.id), buf(cmd.buf), res(cmd.res) {
+    cmd_tp(cmd.cmd_tp), type(cmd.type),  id(cmd.id), off(cmd.off), len(cmd.len), buf(cmd.buf), name(cmd.name), res(cmd.res) {
     // Lab3: Your code here
 }
 chfs_command_raft::~chfs_command_raft() {
@@ -19,7 +22,8 @@ chfs_command_raft::~chfs_command_raft() {
 
 int chfs_command_raft::size() const{ 
     // Lab3: Your code here
-    return sizeof(command_type) + sizeof(type) + sizeof(id) + sizeof(uint32_t) + buf.size();
+    return sizeof(command_type) + sizeof(type) + sizeof(id) + sizeof(off) + sizeof(len) + sizeof(uint32_t) + buf.size()
+        + sizeof(uint32_t) + name.size();
 }
 
 void chfs_command_raft::serialize(char *buf_out, int size) const {
@@ -33,9 +37,18 @@ void chfs_command_raft::serialize(char *buf_out, int size) const {
     pos += sizeof(uint32_t);   
     memcpy(buf_out + pos, (char *) &id, sizeof(id));  // serialize id
     pos += sizeof(id);
+    memcpy(buf_out + pos, (char *) &off, sizeof(off));  // serialize off
+    pos += sizeof(off);
+    memcpy(buf_out + pos, (char *) &len, sizeof(len));  // serialize len
+    pos += sizeof(len);
     memcpy(buf_out + pos, (char *) &(buf_size), sizeof(uint32_t)); // serialize buf size
     pos += sizeof(uint32_t);
     memcpy(buf_out + pos, buf.c_str(), buf.size());  // serialize buf
+    pos += buf.size();
+    int name_size = name.size();
+    memcpy(buf_out + pos, (char *) &name_size, sizeof(uint32_t)); // serialize name size
+    pos += sizeof(uint32_t);
+    memcpy(buf_out + pos, name.c_str(), name.size());  // serialize name
     return;
 }
 
@@ -50,26 +63,52 @@ void chfs_command_raft::deserialize(const char *buf_in, int size) {
     pos += sizeof(type);
     memcpy((char *) &id, buf_in + pos, sizeof(id));  // deserialize id
     pos += sizeof(id);
+    memcpy((char *) &off, buf_in + pos, sizeof(off));  // deserialize off
+    pos += sizeof(off);
+    memcpy((char *) &len, buf_in + pos, sizeof(len));  // deserialize len
+    pos += sizeof(len);
     memcpy((char *) &buf_size, buf_in + pos, sizeof(uint32_t));  // deserialize buf size
     pos += sizeof (uint32_t);
     buf = std::string(buf_in + pos, buf_size);  // deserialize buf
+    pos += buf_size;
+    int name_size = 0;
+    memcpy((char *) &name_size, buf_in + pos, sizeof(uint32_t));  // deserialize name size
+    pos += sizeof(uint32_t);
+    name = std::string(buf_in + pos, name_size);  // deserialize name
     return;
 }
 
 marshall &operator<<(marshall &m, const chfs_command_raft &cmd) {
     // Lab3: Your code here
-    m << (int)cmd.cmd_tp << cmd.type << cmd.id << cmd.buf;
+    m << (int)cmd.cmd_tp << cmd.type << cmd.id << cmd.off << cmd.len << cmd.buf << cmd.name;
     return m;
 }
 
 unmarshall &operator>>(unmarshall &u, chfs_command_raft &cmd) {
     // Lab3: Your code here
     int cmd_tp;
-    u >> cmd_tp >> cmd.type >> cmd.id >> cmd.buf;
+    u >> cmd_tp >> cmd.type >> cmd.id >> cmd.off >> cmd.len >> cmd.buf >> cmd.name;
     cmd.cmd_tp = chfs_command_raft::command_type(cmd_tp);
     return u;
 }
 
+/* Whether the command changes the disk. Only those record their log
+ * index there: replaying a read after a restart is harmless, and
+ * recording it would make every read write the super block. */
+static bool changes_disk(chfs_command_raft::command_type tp) {
+    switch (tp) {
+        case chfs_command_raft::CMD_NONE:
+        case chfs_command_raft::CMD_GET:
+        case chfs_command_raft::CMD_GETA:
+        case chfs_command_raft::CMD_READ:
+        case chfs_command_raft::CMD_LOOKUP:
+        case chfs_command_raft::CMD_READDIR:
+            return false;
+        default:
+            return true;
+    }
+}
+
 void chfs_state_machine::apply_log(raft_command &cmd) {
     chfs_command_raft &chfs_cmd = static_cast<chfs_command_raft &>(cmd);
     // Lab3: Your code here
@@ -77,6 +116,16 @@ void chfs_state_machine::apply_log(raft_command &cmd) {
     std::unique_lock<std::mutex> lock(chfs_cmd.res->mtx);
     mtx.lock();
     chfs_cmd.res->start = std::chrono::system_clock::now();
+    if (++applied <= es.log_index()) {
+        // already on the disk image, nobody waits for a replayed entry
+        mtx.unlock();
+        return;
+    }
+    // the command and its log index commit together, so a crash leaves
+    // either both on the disk or neither
+    bool changes = changes_disk(chfs_cmd.cmd_tp);
+    if (changes)
+        es.begin_op();
     switch (chfs_cmd.cmd_tp) {
         case chfs_command_raft::CMD_NONE:{
             chfs_cmd.res->tp = chfs_cmd.cmd_tp;
@@ -95,6 +144,14 @@ void chfs_state_machine::apply_log(raft_command &cmd) {
             break;
         }
 
+        case chfs_command_raft::CMD_READ:{
+            es.read(chfs_cmd.id, chfs_cmd.off, chfs_cmd.len, chfs_cmd.res->buf);
+            chfs_cmd.res->id  = chfs_cmd.id;
+            chfs_cmd.res->done = chfs_cmd.res->buf.size() > 0;
+            chfs_cmd.res->tp = chfs_cmd.cmd_tp;
+            break;
+        }
+
         case chfs_command_raft::CMD_GETA:{
             //printf("\nchfs_state_machine: get file attr, id : %d\n", chfs_cmd.id);
 //            mtx.lock();
@@ -109,7 +166,7 @@ void chfs_state_machine::apply_log(raft_command &cmd) {
         case chfs_command_raft::CMD_PUT:{
             //printf("\nchfs_state_machine: create file , type : %d\n", chfs_cmd.type);
             int status =  0;
-            es.put(chfs_cmd.id, chfs_cmd.buf, status);
+            chfs_cmd.res->status = es.put(chfs_cmd.id, chfs_cmd.buf, status);
 //            mtx.lock();
             chfs_cmd.res->id  = chfs_cmd.id;
             chfs_cmd.res->buf = chfs_cmd.buf;
@@ -119,6 +176,16 @@ void chfs_state_machine::apply_log(raft_command &cmd) {
             break;
         }
 
+        case chfs_command_raft::CMD_WRITE:{
+            // the log entry only carries the written bytes, not the file
+            int status = 0;
+            chfs_cmd.res->status = es.write(chfs_cmd.id, chfs_cmd.off, chfs_cmd.buf, status);
+            chfs_cmd.res->id  = chfs_cmd.id;
+            chfs_cmd.res->tp = chfs_cmd.cmd_tp;
+            chfs_cmd.res->done = true;
+            break;
+        }
+
         case chfs_command_raft::CMD_CRT:{
             //printf("\nchfs_state_machine: create file , type : %d\n", chfs_cmd.type);
             es.create(chfs_cmd.type, chfs_cmd.id);
@@ -139,9 +206,73 @@ void chfs_state_machine::apply_log(raft_command &cmd) {
             chfs_cmd.res->done = status > 0;
             chfs_cmd.res->tp = chfs_cmd.cmd_tp;
 //            mtx.unlock();
+            break;
+        }
+
+        case chfs_command_raft::CMD_LOOKUP:{
+            chfs_cmd.res->status = es.lookup(chfs_cmd.id, chfs_cmd.name, chfs_cmd.res->id);
+            chfs_cmd.res->tp = chfs_cmd.cmd_tp;
+            chfs_cmd.res->done = true;
+            break;
+        }
+
+        case chfs_command_raft::CMD_ADD_ENTRY:{
+            int status = 0;
+            chfs_cmd.res->status = es.add_entry(chfs_cmd.id, chfs_cmd.name, chfs_cmd.off, status);
+            chfs_cmd.res->id = chfs_cmd.off;
+            chfs_cmd.res->tp = chfs_cmd.cmd_tp;
+            chfs_cmd.res->done = true;
+            break;
+        }
+
+        case chfs_command_raft::CMD_RMV_ENTRY:{
+            chfs_cmd.res->status = es.remove_entry(chfs_cmd.id, chfs_cmd.name, chfs_cmd.res->id);
+            chfs_cmd.res->tp = chfs_cmd.cmd_tp;
+            chfs_cmd.res->done = true;
+            break;
+        }
+
+        case chfs_command_raft::CMD_CRT_ENTRY:{
+            // the log entry carries the name and the initial contents,
+            // not the directory blocks they end up in
+            chfs_cmd.res->status = es.create_entry(chfs_cmd.id, chfs_cmd.type, chfs_cmd.name,
+                                                   chfs_cmd.buf, chfs_cmd.res->id);
+            chfs_cmd.res->tp = chfs_cmd.cmd_tp;
+            chfs_cmd.res->done = true;
+            break;
+        }
+
+        case chfs_command_raft::CMD_COMPOUND:{
+            // one log entry for the whole sequence
+            std::vector<extent_protocol::op> ops;
+            unmarshall u(chfs_cmd.buf);
+            u >> ops;
+            chfs_cmd.res->results.clear();
+            chfs_cmd.res->status = es.compound(ops, chfs_cmd.res->results);
+            chfs_cmd.res->tp = chfs_cmd.cmd_tp;
+            chfs_cmd.res->done = true;
+            break;
+        }
+
+        case chfs_command_raft::CMD_READDIR:{
+            unsigned long long cookie;
+            unmarshall u(chfs_cmd.buf);
+            u >> cookie;
+            chfs_cmd.res->entries.clear();
+            chfs_cmd.res->status = es.readdir(chfs_cmd.id, cookie, chfs_cmd.off,
+                                              chfs_cmd.res->entries);
+            chfs_cmd.res->tp = chfs_cmd.cmd_tp;
+            chfs_cmd.res->done = true;
+            break;
         }
     }
 
+    if (changes) {
+        es.set_log_index(applied);
+        es.end_op();
+    }
+    // applied, whatever came of it; the caller waits for done
+    chfs_cmd.res->done = true;
     chfs_cmd.res->cv.notify_all();
     mtx.unlock();
     return;
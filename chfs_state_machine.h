@@ -12,6 +12,14 @@ public:
         CMD_GET,  
         CMD_GETA, 
         CMD_RMV,   
+        CMD_READ,
+        CMD_WRITE,
+        CMD_LOOKUP,     // directory operations, see extent_server
+        CMD_ADD_ENTRY,
+        CMD_RMV_ENTRY,
+        CMD_CRT_ENTRY,
+        CMD_COMPOUND,   // buf holds the marshalled ops
+        CMD_READDIR,    // buf holds the cookie, off the entry limit
     };
 
     struct result {
@@ -20,6 +28,9 @@ public:
         std::string buf;
         extent_protocol::attr attr;
         command_type tp;
+        int status;                 // of the directory operations
+        std::vector<extent_protocol::op_result> results;   // of CMD_COMPOUND
+        std::vector<extent_protocol::dirent> entries;      // of CMD_READDIR
 
         bool done;
         std::mutex mtx;             
@@ -37,7 +48,10 @@ public:
     command_type cmd_tp;
     uint32_t type;
     extent_protocol::extentid_t id;
+    uint32_t off;   // byte range of CMD_READ / CMD_WRITE,
+    uint32_t len;   // off is the inum CMD_ADD_ENTRY links
     std::string buf;
+    std::string name;   // entry name of the directory operations
     std::shared_ptr<result> res;
 
     chfs_command_raft();
@@ -59,6 +73,11 @@ unmarshall &operator>>(unmarshall &u, chfs_command_raft &cmd);
 
 class chfs_state_machine : public raft_state_machine {
 public:
+    // With an image the disk outlives the node: a restarted node skips
+    // the log entries the image already reflects instead of replaying them.
+    chfs_state_machine(const char *image = NULL,
+                       const disk_geometry &geo = disk_geometry()) : es(image, geo), applied(0) {
+    }
     virtual ~chfs_state_machine() {
     }
     virtual void apply_log(raft_command &cmd) override;
@@ -71,6 +90,9 @@ public:
 private:
     extent_server es;
     std::mutex mtx;
+    // Log index of the last entry handed to apply_log. The log of a chfs
+    // node is never compacted, so apply_log sees every entry from index 1.
+    uint32_t applied;
     // Lab3: Your code here
     // You can add your own variables and functions here if you want.
 
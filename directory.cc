@@ -0,0 +1,371 @@
+// directory format, see directory.h.
+
+#include "directory.h"
+#include <stdio.h>
+#include <string.h>
+#include <algorithm>
+#include <map>
+
+#define LEAF(s)        ((dir_leaf_t *)&(s)[0])
+#define ENTRY(s, off)  ((dir_entry_t *)&(s)[off])
+#define REC_LEN(len)   ((sizeof(dir_entry_t) + (len) + 3) & ~3u)
+
+directory::directory(io *d) : dio(d)
+{
+}
+
+/* FNV-1a. */
+uint32_t
+directory::hash(const std::string &name)
+{
+    uint32_t h = 2166136261u;
+    for (size_t i = 0; i < name.size(); ++i)
+        h = (h ^ (unsigned char)name[i]) * 16777619u;
+    return h;
+}
+
+/* Read block 0; an empty file reads as a directory with no blocks. */
+extent_protocol::status
+directory::read_header(dir_header_t *h)
+{
+    std::string buf;
+
+    if (dio->read(0, buf) != extent_protocol::OK)
+        return extent_protocol::IOERR;
+    buf.resize(DIR_BLOCK, 0);
+    memcpy(h, buf.data(), sizeof(*h));
+    if (h->magic == 0) {
+        memset(h, 0, sizeof(*h));
+        return extent_protocol::OK;
+    }
+    if (h->magic != DIR_MAGIC) {
+        printf("directory: bad magic %x\n", h->magic);
+        return extent_protocol::IOERR;
+    }
+    return extent_protocol::OK;
+}
+
+/* The index slot of name in leaf, -1 if it is not there. */
+int
+directory::leaf_find(const std::string &leaf, const std::string &name, uint32_t h)
+{
+    const dir_leaf_t *l = LEAF(leaf);
+    uint32_t start = (h >> 16) % DIR_SLOTS;
+
+    for (uint32_t i = 0; i < DIR_SLOTS; ++i) {
+        uint32_t s = (start + i) % DIR_SLOTS;
+        if (l->slots[s] == DIR_SLOT_FREE)
+            return -1;
+        if (l->slots[s] == DIR_SLOT_DEAD)
+            continue;
+        const dir_entry_t *e = ENTRY(leaf, l->slots[s]);
+        if (e->hash == h && e->name_len == name.size()
+            && memcmp(e + 1, name.data(), name.size()) == 0)
+            return s;
+    }
+    return -1;
+}
+
+/* Rewrite leaf with only its live entries, reclaiming the space and
+ * index slots of removed ones. */
+void
+directory::leaf_compact(std::string &leaf)
+{
+    std::string old = leaf;
+    const dir_leaf_t *ol = LEAF(old);
+    dir_leaf_t *l = LEAF(leaf);
+
+    memset(&leaf[0], 0, DIR_BLOCK);
+    l->next = ol->next;
+    l->tail = sizeof(dir_leaf_t);
+    for (uint32_t off = sizeof(dir_leaf_t); off < ol->tail; ) {
+        const dir_entry_t *e = ENTRY(old, off);
+        if (e->inum != 0)
+            leaf_insert(leaf, std::string((const char *)(e + 1), e->name_len),
+                        e->hash, e->inum);
+        off += e->rec_len;
+    }
+}
+
+/* Add an entry to leaf, which must not hold name yet; false if the
+ * leaf is full. */
+bool
+directory::leaf_insert(std::string &leaf, const std::string &name, uint32_t h, uint32_t inum)
+{
+    dir_leaf_t *l = LEAF(leaf);
+    uint32_t rec_len = REC_LEN(name.size());
+    uint32_t start = (h >> 16) % DIR_SLOTS;
+    bool has_free = false;
+
+    if (l->tail == 0)
+        l->tail = sizeof(dir_leaf_t);   // a fresh leaf
+    if (l->count >= DIR_MAX_ENTRIES)
+        return false;
+    for (uint32_t s = 0; s < DIR_SLOTS && !has_free; ++s)
+        has_free = l->slots[s] == DIR_SLOT_FREE;
+    if (l->tail + rec_len > DIR_BLOCK || !has_free) {
+        leaf_compact(leaf);
+        if (l->tail + rec_len > DIR_BLOCK)
+            return false;
+    }
+
+    for (uint32_t i = 0; i < DIR_SLOTS; ++i) {
+        uint32_t s = (start + i) % DIR_SLOTS;
+        if (l->slots[s] == DIR_SLOT_FREE || l->slots[s] == DIR_SLOT_DEAD) {
+            dir_entry_t *e = ENTRY(leaf, l->tail);
+            e->hash = h;
+            e->inum = inum;
+            e->name_len = name.size();
+            e->rec_len = rec_len;
+            memcpy(e + 1, name.data(), name.size());
+            l->slots[s] = l->tail;
+            l->tail += rec_len;
+            l->count++;
+            return true;
+        }
+    }
+    return false;
+}
+
+/* Walk the chain of name's bucket. On OK, leaf_no, leaf and slot say
+ * where the entry is. */
+extent_protocol::status
+directory::find(const std::string &name, uint32_t h,
+                uint32_t &leaf_no, std::string &leaf, int &slot)
+{
+    dir_header_t hdr;
+
+    if (read_header(&hdr) != extent_protocol::OK)
+        return extent_protocol::IOERR;
+    for (leaf_no = hdr.buckets[h % DIR_BUCKETS]; leaf_no != 0; leaf_no = LEAF(leaf)->next) {
+        if (leaf_no >= hdr.nblocks || dio->read(leaf_no, leaf) != extent_protocol::OK)
+            return extent_protocol::IOERR;
+        leaf.resize(DIR_BLOCK, 0);
+        slot = leaf_find(leaf, name, h);
+        if (slot >= 0)
+            return extent_protocol::OK;
+    }
+    return extent_protocol::NOENT;
+}
+
+extent_protocol::status
+directory::lookup(const std::string &name, uint32_t &inum)
+{
+    uint32_t leaf_no;
+    std::string leaf;
+    int slot;
+    extent_protocol::status r;
+
+    if (name.empty() || name.size() > DIR_NAME_MAX)
+        return extent_protocol::NOENT;
+    r = find(name, hash(name), leaf_no, leaf, slot);
+    if (r == extent_protocol::OK)
+        inum = ENTRY(leaf, LEAF(leaf)->slots[slot])->inum;
+    return r;
+}
+
+/* Move the entries of leaf whose bucket is at or past mid to split. */
+void
+directory::leaf_split(std::string &leaf, std::string &split, uint32_t mid)
+{
+    std::string old = leaf;
+    const dir_leaf_t *ol = LEAF(old);
+
+    leaf.assign(DIR_BLOCK, 0);
+    split.assign(DIR_BLOCK, 0);
+    for (uint32_t off = sizeof(dir_leaf_t); off < ol->tail; ) {
+        const dir_entry_t *e = ENTRY(old, off);
+        if (e->inum != 0)
+            leaf_insert(e->hash % DIR_BUCKETS >= mid ? split : leaf,
+                        std::string((const char *)(e + 1), e->name_len), e->hash, e->inum);
+        off += e->rec_len;
+    }
+}
+
+extent_protocol::status
+directory::add(const std::string &name, uint32_t inum)
+{
+    uint32_t h = hash(name);
+    uint32_t bucket = h % DIR_BUCKETS;
+    dir_header_t hdr;
+    std::vector<std::pair<uint32_t, std::string> > chain;
+    bool hdr_dirty = false;
+
+    if (name.empty() || name.size() > DIR_NAME_MAX || inum == 0)
+        return extent_protocol::IOERR;
+    if (read_header(&hdr) != extent_protocol::OK)
+        return extent_protocol::IOERR;
+    if (hdr.magic == 0) {
+        // the first entry: one leaf, shared by every bucket
+        hdr.magic = DIR_MAGIC;
+        hdr.nblocks = 2;
+        for (uint32_t i = 0; i < DIR_BUCKETS; ++i)
+            hdr.buckets[i] = 1;
+        chain.push_back(std::make_pair(1u, std::string(DIR_BLOCK, 0)));
+        hdr_dirty = true;
+    }
+    else {
+        // the name must be new; remember the leaves on the way
+        for (uint32_t b = hdr.buckets[bucket]; b != 0; b = LEAF(chain.back().second)->next) {
+            chain.push_back(std::make_pair(b, std::string()));
+            if (b >= hdr.nblocks || dio->read(b, chain.back().second) != extent_protocol::OK)
+                return extent_protocol::IOERR;
+            chain.back().second.resize(DIR_BLOCK, 0);
+            if (leaf_find(chain.back().second, name, h) >= 0)
+                return extent_protocol::EXIST;
+        }
+    }
+    for (size_t i = 0; i < chain.size(); ++i) {
+        if (leaf_insert(chain[i].second, name, h, inum)) {
+            if (dio->write(chain[i].first, chain[i].second) != extent_protocol::OK)
+                return extent_protocol::IOERR;
+            return hdr_dirty ? dio->write(0, std::string((const char *)&hdr, sizeof(hdr)))
+                             : extent_protocol::OK;
+        }
+    }
+
+    // every leaf of the chain is full. A leaf shared by several buckets
+    // gives the upper half of them to a new leaf, like extendible
+    // hashing, until the name fits; a leaf of a single bucket gets a
+    // new leaf chained in front of it. The leaves are split in memory,
+    // then written new ones first: only those grow the directory, so
+    // only they can fail for want of space, and until the header points
+    // at them they are not part of the directory.
+    uint32_t head = chain[0].first;
+    std::string leaf = chain[0].second;
+    std::map<uint32_t, std::string> added;
+    std::string old;
+    while (true) {
+        uint32_t lo = bucket, hi = bucket + 1;
+        while (lo > 0 && hdr.buckets[lo - 1] == head)
+            --lo;
+        while (hi < DIR_BUCKETS && hdr.buckets[hi] == head)
+            ++hi;
+
+        uint32_t nb = hdr.nblocks++;
+        std::string split;
+        if (hi - lo == 1) {
+            split.assign(DIR_BLOCK, 0);
+            LEAF(split)->next = head;
+            hdr.buckets[bucket] = nb;
+            leaf_insert(split, name, h, inum);
+            added[nb] = split;
+            break;
+        }
+        uint32_t mid = (lo + hi) / 2;
+        leaf_split(leaf, split, mid);
+        for (uint32_t i = mid; i < hi; ++i)
+            hdr.buckets[i] = nb;
+        bool done = leaf_insert(bucket >= mid ? split : leaf, name, h, inum);
+        if (head == chain[0].first)
+            old = leaf;
+        else
+            added[head] = leaf;
+        added[nb] = split;
+        if (done)
+            break;
+        if (bucket >= mid) {
+            head = nb;
+            leaf = split;
+        }
+    }
+    std::map<uint32_t, std::string>::iterator it;
+    for (it = added.begin(); it != added.end(); ++it) {
+        if (dio->write(it->first, it->second) != extent_protocol::OK)
+            return extent_protocol::IOERR;
+    }
+    if (!old.empty() && dio->write(chain[0].first, old) != extent_protocol::OK)
+        return extent_protocol::IOERR;
+    if (dio->write(0, std::string((const char *)&hdr, sizeof(hdr))) != extent_protocol::OK) {
+        // the old leaf must hold its entries again
+        if (!old.empty())
+            dio->write(chain[0].first, chain[0].second);
+        return extent_protocol::IOERR;
+    }
+    return extent_protocol::OK;
+}
+
+extent_protocol::status
+directory::remove(const std::string &name, uint32_t &inum)
+{
+    uint32_t leaf_no;
+    std::string leaf;
+    int slot;
+    extent_protocol::status r;
+
+    if (name.empty() || name.size() > DIR_NAME_MAX)
+        return extent_protocol::NOENT;
+    r = find(name, hash(name), leaf_no, leaf, slot);
+    if (r != extent_protocol::OK)
+        return r;
+    dir_leaf_t *l = LEAF(leaf);
+    dir_entry_t *e = ENTRY(leaf, l->slots[slot]);
+    inum = e->inum;
+    e->inum = 0;
+    l->slots[slot] = DIR_SLOT_DEAD;
+    l->count--;
+    return dio->write(leaf_no, leaf);
+}
+
+/* Append the live entries of leaf at or past cookie in list order. */
+void
+directory::leaf_list(const std::string &leaf, uint64_t cookie, std::vector<entry> &entries)
+{
+    const dir_leaf_t *l = LEAF(leaf);
+
+    for (uint32_t off = sizeof(dir_leaf_t); off < l->tail && off < DIR_BLOCK; ) {
+        const dir_entry_t *e = ENTRY(leaf, off);
+        if (e->rec_len == 0)
+            break;
+        if (e->inum != 0 && order(e->hash) >= cookie) {
+            entry ent;
+            ent.name.assign((const char *)(e + 1), e->name_len);
+            ent.inum = e->inum;
+            ent.cookie = order(e->hash) + 1;
+            entries.push_back(ent);
+        }
+        off += e->rec_len;
+    }
+}
+
+static bool
+entry_less(const directory::entry &a, const directory::entry &b)
+{
+    return a.cookie != b.cookie ? a.cookie < b.cookie : a.name < b.name;
+}
+
+/* The buckets sharing a leaf are listed together: the entries of the
+ * leaf, and of the chain behind it, sorted. */
+extent_protocol::status
+directory::list(uint64_t cookie, uint32_t max, std::vector<entry> &entries)
+{
+    dir_header_t hdr;
+    std::string leaf;
+    size_t start = entries.size();
+
+    if (read_header(&hdr) != extent_protocol::OK)
+        return extent_protocol::IOERR;
+    if (hdr.magic == 0)
+        return extent_protocol::OK;
+    for (uint32_t b = cookie >> 32; b < DIR_BUCKETS; ) {
+        uint32_t head = hdr.buckets[b], hi = b + 1;
+        while (hi < DIR_BUCKETS && hdr.buckets[hi] == head)
+            ++hi;
+        std::vector<entry> found;
+        for (uint32_t n = head; n != 0; n = LEAF(leaf)->next) {
+            if (n >= hdr.nblocks || dio->read(n, leaf) != extent_protocol::OK)
+                return extent_protocol::IOERR;
+            leaf.resize(DIR_BLOCK, 0);
+            leaf_list(leaf, cookie, found);
+        }
+        std::sort(found.begin(), found.end(), entry_less);
+        for (size_t i = 0; i < found.size(); ++i) {
+            if (entries.size() > start && entries.size() - start >= max
+                && found[i].cookie != entries.back().cookie)
+                return extent_protocol::OK;
+            entries.push_back(found[i]);
+        }
+        b = hi;
+    }
+    return extent_protocol::OK;
+}
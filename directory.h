@@ -0,0 +1,114 @@
+// directory format.
+
+#ifndef directory_h
+#define directory_h
+
+#include <stdint.h>
+#include <string>
+#include <vector>
+#include "extent_protocol.h"
+
+// A directory is a file of DIR_BLOCK byte blocks; an empty file is an
+// empty directory. Block 0 holds a hash table of DIR_BUCKETS buckets,
+// each pointing at the leaf block its names live in. Neighbouring
+// buckets share a leaf until it fills up and is split; a full leaf of
+// a single bucket starts a chain. A name is looked up only in the leaves
+// of its bucket, and inside each leaf through an in-block hash index,
+// so lookup and insert read a couple of blocks whatever the size of
+// the directory.
+//
+// A leaf is a header, the index (DIR_SLOTS entry offsets, open
+// addressing) and the entries, each a fixed size header followed by
+// the name. A removed entry keeps its space, with inum 0, until the
+// leaf is compacted by a later insert.
+//
+// list walks the entries in the order of their bucket and then their
+// hash, which depends on the names alone: a cookie, the place after an
+// entry in that order, stays good while the directory changes around
+// it, unlike an offset in a leaf that compaction and splits move.
+//
+// DIR_BLOCK is a unit of the directory file, not of the disk, and is
+// fixed rather than BLOCK_SIZE: an image keeps the block size it was
+// made with, so a directory written on one must read the same on any
+// other, and the header and leaf layouts are sized at compile time.
+// Directory blocks are read and written by byte range, so one spans
+// several disk blocks or shares one as the geometry has it.
+
+#define DIR_BLOCK   4096
+#define DIR_MAGIC   0x64697231   // "dir1"
+#define DIR_BUCKETS ((DIR_BLOCK - 8) / sizeof(uint32_t))
+#define DIR_SLOTS   128
+#define DIR_MAX_ENTRIES (DIR_SLOTS * 3 / 4)   // per leaf, keeps probes short
+#define DIR_NAME_MAX 255
+
+typedef struct dir_header {
+    uint32_t magic;
+    uint32_t nblocks;                 // blocks in the directory file
+    uint32_t buckets[DIR_BUCKETS];    // first leaf of each chain, 0 = none
+} dir_header_t;
+
+typedef struct dir_leaf {
+    uint32_t next;                    // next leaf of the chain, 0 = none
+    uint16_t count;                   // live entries
+    uint16_t tail;                    // end of the used entry space
+    uint16_t slots[DIR_SLOTS];        // DIR_SLOT_FREE, DIR_SLOT_DEAD or an offset
+} dir_leaf_t;
+
+#define DIR_SLOT_FREE 0
+#define DIR_SLOT_DEAD 1
+
+typedef struct dir_entry {
+    uint32_t hash;
+    uint32_t inum;                    // 0 once removed
+    uint16_t name_len;
+    uint16_t rec_len;                 // header, name and padding
+} dir_entry_t;
+
+static_assert(sizeof(dir_header_t) == DIR_BLOCK, "directory header fills block 0");
+
+class directory {
+public:
+    // Block access to the directory file, however it is stored.
+    class io {
+    public:
+        virtual ~io() {}
+        // block b of the file, zero filled past its end
+        virtual extent_protocol::status read(uint32_t b, std::string &block) = 0;
+        virtual extent_protocol::status write(uint32_t b, const std::string &block) = 0;
+    };
+
+    struct entry {
+        std::string name;
+        uint32_t inum;
+        uint64_t cookie;              // where list goes on after this entry
+    };
+
+    directory(io *dio);
+
+    // OK, NOENT, or IOERR if the directory cannot be read
+    extent_protocol::status lookup(const std::string &name, uint32_t &inum);
+    // OK, EXIST, or IOERR
+    extent_protocol::status add(const std::string &name, uint32_t inum);
+    // OK or NOENT; inum is what the name referred to
+    extent_protocol::status remove(const std::string &name, uint32_t &inum);
+    // Appends the entries from cookie on, 0 for the first, stopping
+    // after max of them; names of the same hash are not split up.
+    // Fewer than max means the end of the directory.
+    extent_protocol::status list(uint64_t cookie, uint32_t max, std::vector<entry> &entries);
+
+    static uint32_t hash(const std::string &name);
+
+private:
+    io *dio;
+    extent_protocol::status read_header(dir_header_t *h);
+    extent_protocol::status find(const std::string &name, uint32_t h,
+                                 uint32_t &leaf_no, std::string &leaf, int &slot);
+    static int leaf_find(const std::string &leaf, const std::string &name, uint32_t h);
+    static bool leaf_insert(std::string &leaf, const std::string &name, uint32_t h, uint32_t inum);
+    static void leaf_compact(std::string &leaf);
+    static void leaf_split(std::string &leaf, std::string &split, uint32_t mid);
+    static uint64_t order(uint32_t h) { return ((uint64_t)(h % DIR_BUCKETS) << 32) | h; }
+    static void leaf_list(const std::string &leaf, uint64_t cookie, std::vector<entry> &entries);
+};
+
+#endif
@@ -6,29 +6,287 @@
 #include <stdio.h>
 #include <unistd.h>
 #include <time.h>
+#include <algorithm>
 
-extent_client::extent_client(std::string dst) {
+extent_client::extent_client(std::string dst, int lease_ms) : lease(lease_ms), watcher(NULL), epoch(0) {
     sockaddr_in dstsock;
     make_sockaddr(dst.c_str(), &dstsock);
     cl = new rpcc(dstsock);
     if (cl->bind() != 0) {
         printf("extent_client: bind failed\n");
     }
+    calls = 0;
+    copied = 0;
+}
+
+extent_client::~extent_client() {
+    flush();
+}
+
+/* The cache entry of eid, NULL if there is none or its lease ran out;
+ * the writes an expired entry holds are written back first, and while
+ * that fails the entry is kept and returned. With a watcher, an expired
+ * entry keeps its attributes to compare the next ones with. */
+extent_client::cached_extent *
+extent_client::lookup_cache(extent_protocol::extentid_t eid) {
+    std::map<extent_protocol::extentid_t, cached_extent>::iterator it = cache.find(eid);
+    if (it == cache.end())
+        return NULL;
+    cached_extent &e = it->second;
+    if (clock::now() < e.expires)
+        return &e;
+    if (write_back(eid, &e) != extent_protocol::OK)
+        return &e;
+    if (watcher && (e.has_attr || e.stale)) {
+        if (e.has_attr)
+            e.stale_attr = e.attr;
+        e.stale = true;
+        e.has_attr = e.has_data = false;
+        e.data.clear();
+        return NULL;
+    }
+    cache.erase(it);
+    return NULL;
+}
+
+/* A new, empty entry for eid under a fresh lease. A full cache first
+ * drops the expired entries, and everything if that is not enough;
+ * entries whose writes the server did not take stay. */
+extent_client::cached_extent *
+extent_client::insert_cache(extent_protocol::extentid_t eid) {
+    if (lease.count() == 0)
+        return NULL;
+    if (cache.size() >= EXTENT_CACHE_SIZE && cache.find(eid) == cache.end()) {
+        clock::time_point now = clock::now();
+        std::map<extent_protocol::extentid_t, cached_extent>::iterator it;
+        for (it = cache.begin(); it != cache.end(); ) {
+            if (it->second.expires <= now
+                && write_back(it->first, &it->second) == extent_protocol::OK) {
+                cache.erase(it++);
+            } else {
+                ++it;
+            }
+        }
+        if (cache.size() >= EXTENT_CACHE_SIZE) {
+            flush_all();
+            for (it = cache.begin(); it != cache.end(); ) {
+                if (it->second.dirty)
+                    ++it;
+                else
+                    cache.erase(it++);
+            }
+        }
+    }
+    bool fresh = cache.find(eid) == cache.end();
+    cached_extent &e = cache[eid];
+    if (fresh)
+        e.stale = false;
+    e.expires = clock::now() + lease;
+    e.has_attr = false;
+    e.has_data = false;
+    e.data.clear();
+    e.dirty = false;
+    e.truncated = false;
+    e.dirty_from = e.dirty_to = 0;
+    return &e;
+}
+
+/* Forget eid, without writing it back; the server changed it. */
+void
+extent_client::invalidate(extent_protocol::extentid_t eid) {
+    cache.erase(eid);
+}
+
+/* Like invalidate, for a change made without mtx held: writes cached
+ * in the meantime go back first, and stay if the server fails them. */
+void
+extent_client::forget(extent_protocol::extentid_t eid) {
+    std::map<extent_protocol::extentid_t, cached_extent>::iterator it = cache.find(eid);
+    if (it != cache.end() && write_back(eid, &it->second) == extent_protocol::OK)
+        cache.erase(it);
+}
+
+/* The op that writes back e, false if it is clean. The op points into
+ * the cached data, which must not change until the call is made; e
+ * stays dirty until the server has taken the op, see written_back. */
+bool
+extent_client::write_back_op(extent_protocol::extentid_t eid, cached_extent *e,
+                             extent_protocol::op &o) {
+    if (!e->dirty)
+        return false;
+    o.id = eid;
+    o.type = 0;
+    o.len = 0;
+    if (e->truncated) {
+        o.proc = extent_protocol::put;
+        o.off = 0;
+        o.data.data = e->data.data();
+        o.data.size = e->data.size();
+    } else {
+        o.proc = extent_protocol::write;
+        o.off = e->dirty_from;
+        o.data.data = e->data.data() + e->dirty_from;
+        o.data.size = e->dirty_to - e->dirty_from;
+    }
+    copied += o.data.size;   // into the request
+    return true;
+}
+
+/* The server took the writes of e. */
+void
+extent_client::written_back(cached_extent *e) {
+    e->dirty = false;
+    e->truncated = false;
+}
+
+extent_protocol::status
+extent_client::write_back(extent_protocol::extentid_t eid, cached_extent *e) {
+    int r;
+    extent_protocol::status ret = extent_protocol::OK;
+    extent_protocol::op o;
+    if (!write_back_op(eid, e, o))
+        return ret;
+    calls++;
+    if (o.proc == extent_protocol::put) {
+        ret = call(extent_protocol::put, eid, o.data, r);
+    } else {
+        ret = call(extent_protocol::write, eid, o.off, o.data, r);
+    }
+    VERIFY(ret >= extent_protocol::OK);
+    if (ret == extent_protocol::OK)
+        written_back(e);
+    return ret;
+}
+
+extent_protocol::status
+extent_client::call_compound(const std::vector<extent_protocol::op> &ops,
+                             std::vector<extent_protocol::op_result> &results) {
+    extent_protocol::status ret = extent_protocol::OK;
+    calls++;
+    ret = call(extent_protocol::compound, ops, results);
+    VERIFY(ret >= extent_protocol::OK);
+    return ret;
+}
+
+/* The cached attributes after a local change of the contents. */
+void
+extent_client::touch(cached_extent *e, uint32_t size) {
+    e->attr.size = size;
+    e->attr.mtime = e->attr.ctime = time(NULL);
+}
+
+/* Remember the attributes a call returned, unless eid is cached with
+ * its own, which may include writes the server has not seen. */
+void
+extent_client::cache_attr(extent_protocol::extentid_t eid, const extent_protocol::attr &a) {
+    cached_extent *e = lookup_cache(eid);
+    if (a.type == 0) {
+        // gone; tell the watcher if it was cached before
+        std::map<extent_protocol::extentid_t, cached_extent>::iterator it = cache.find(eid);
+        if (it != cache.end() && it->second.stale) {
+            cache.erase(it);
+            watcher->changed(eid);
+        }
+        return;
+    }
+    if (e && e->has_attr)
+        return;
+    if (e || (e = insert_cache(eid))) {
+        e->has_attr = true;
+        e->attr = a;
+        if (e->has_data)
+            e->attr.size = e->data.size();
+        if (e->stale) {
+            e->stale = false;
+            if (watcher && (a.type != e->stale_attr.type || a.size != e->stale_attr.size
+                            || a.mtime != e->stale_attr.mtime || a.ctime != e->stale_attr.ctime))
+                watcher->changed(eid);
+        }
+    }
 }
 
 extent_protocol::status
 extent_client::create(uint32_t type,  extent_protocol::extentid_t &id) {
     extent_protocol::status ret = extent_protocol::OK;
-    ret = cl->call(extent_protocol::create, type,  id);
+    calls++;
+    ret = call(extent_protocol::create, type,  id);
     VERIFY(ret == extent_protocol::OK);
     return ret;
 }
 
+/* Cache the contents of eid a call fetched, unless a change may have
+ * overtaken it. With keep the caller keeps data, otherwise the cache
+ * takes it over. */
+void
+extent_client::cache_data(extent_protocol::extentid_t eid, std::string &data,
+                          uint64_t seen, bool keep) {
+    cached_extent *e = lookup_cache(eid);
+    if (epoch != seen || data.size() > EXTENT_CACHE_DATA || (e && e->has_data)
+        || !(e || (e = insert_cache(eid))))
+        return;
+    e->has_data = true;
+    if (keep) {
+        e->data = data;
+        copied += data.size();
+    } else {
+        e->data.swap(data);
+    }
+    if (e->has_attr)
+        e->attr.size = e->data.size();
+}
+
 extent_protocol::status
 extent_client::get(extent_protocol::extentid_t eid, std::string &buf) {
     extent_protocol::status ret = extent_protocol::OK;
-    ret = cl->call(extent_protocol::get, eid, buf);
+    std::unique_lock<std::mutex> lock(mtx);
+    cached_extent *e = lookup_cache(eid);
+    if (e && e->has_data) {
+        buf = e->data;
+        copied += buf.size();
+        return ret;
+    }
+    uint64_t seen = epoch;
+    lock.unlock();
+    calls++;
+    ret = call(extent_protocol::get, eid, buf);
     VERIFY(ret == extent_protocol::OK);
+    copied += buf.size();
+    lock.lock();
+    cache_data(eid, buf, seen, true);
+    return ret;
+}
+
+/* Only the bytes asked for are copied out of the cache or the reply. */
+extent_protocol::status
+extent_client::read(extent_protocol::extentid_t eid, unsigned int off,
+                    unsigned int len, std::string &buf) {
+    extent_protocol::status ret = extent_protocol::OK;
+    std::unique_lock<std::mutex> lock(mtx);
+    cached_extent *e = lookup_cache(eid);
+    if (e && e->has_data) {
+        buf.assign(e->data, std::min((size_t)off, e->data.size()), len);
+        copied += buf.size();
+        return ret;
+    }
+    bool whole = e && e->has_attr && e->attr.size <= EXTENT_CACHE_DATA;
+    uint64_t seen = epoch;
+    lock.unlock();
+    if (whole) {
+        // a small extent is cached whole on its first read
+        std::string data;
+        calls++;
+        ret = call(extent_protocol::get, eid, data);
+        VERIFY(ret == extent_protocol::OK);
+        buf.assign(data, std::min((size_t)off, data.size()), len);
+        copied += data.size() + buf.size();
+        lock.lock();
+        cache_data(eid, data, seen, false);
+        return ret;
+    }
+    calls++;
+    ret = call(extent_protocol::read, eid, off, len, buf);
+    VERIFY(ret == extent_protocol::OK);
+    copied += buf.size();
     return ret;
 }
 
@@ -36,8 +294,20 @@ extent_protocol::status
 extent_client::getattr(extent_protocol::extentid_t eid,
                        extent_protocol::attr &attr) {
     extent_protocol::status ret = extent_protocol::OK;
-    ret = cl->call(extent_protocol::getattr, eid, attr);
+    std::unique_lock<std::mutex> lock(mtx);
+    cached_extent *e = lookup_cache(eid);
+    if (e && e->has_attr) {
+        attr = e->attr;
+        return ret;
+    }
+    uint64_t seen = epoch;
+    lock.unlock();
+    calls++;
+    ret = call(extent_protocol::getattr, eid, attr);
     VERIFY(ret == extent_protocol::OK);
+    lock.lock();
+    if (epoch == seen)
+        cache_attr(eid, attr);
     return ret;
 }
 
@@ -45,8 +315,78 @@ extent_protocol::status
 extent_client::put(extent_protocol::extentid_t eid, std::string buf) {
     int r;
     extent_protocol::status ret = extent_protocol::OK;
-    ret = cl->call(extent_protocol::put, eid, buf,  r);
-    VERIFY(ret == extent_protocol::OK);
+    std::unique_lock<std::mutex> lock(mtx);
+    cached_extent *e = lookup_cache(eid);
+    if (e && e->has_data && buf.size() <= EXTENT_CACHE_DATA) {
+        e->data.swap(buf);
+        e->dirty = true;
+        e->truncated = true;
+        touch(e, e->data.size());
+        return ret;
+    }
+    if (e && e->has_data) {
+        if ((ret = write_back(eid, e)) != extent_protocol::OK)
+            return ret;
+        invalidate(eid);
+    }
+    epoch++;
+    lock.unlock();
+    calls++;
+    ret = call(extent_protocol::put, eid, buf,  r);
+    VERIFY(ret >= extent_protocol::OK);
+    copied += buf.size();
+    lock.lock();
+    if (ret == extent_protocol::OK && (e = lookup_cache(eid)) != NULL)
+        touch(e, buf.size());
+    return ret;
+}
+
+extent_protocol::status
+extent_client::write(extent_protocol::extentid_t eid, unsigned int off,
+                     std::string buf) {
+    return write(eid, off, buf.data(), buf.size());
+}
+
+/* data goes into the cache, or on the wire, without another copy. */
+extent_protocol::status
+extent_client::write(extent_protocol::extentid_t eid, unsigned int off,
+                     const char *data, size_t len) {
+    int r;
+    extent_protocol::status ret = extent_protocol::OK;
+    std::unique_lock<std::mutex> lock(mtx);
+    cached_extent *e = lookup_cache(eid);
+    if (e && e->has_data && off + len <= EXTENT_CACHE_DATA) {
+        uint32_t end = off + len;
+        if (end > e->data.size())
+            e->data.resize(end, '\0');
+        e->data.replace(off, len, data, len);
+        copied += len;
+        if (!e->dirty) {
+            e->dirty_from = off;
+            e->dirty_to = end;
+        } else {
+            e->dirty_from = std::min(e->dirty_from, (uint32_t)off);
+            e->dirty_to = std::max(e->dirty_to, end);
+        }
+        e->dirty = true;
+        touch(e, e->data.size());
+        return ret;
+    }
+    if (e && e->has_data) {
+        if ((ret = write_back(eid, e)) != extent_protocol::OK)
+            return ret;
+        invalidate(eid);
+    }
+    epoch++;
+    lock.unlock();
+    extent_protocol::bytes b = { data, len };
+    calls++;
+    ret = call(extent_protocol::write, eid, off, b, r);
+    VERIFY(ret >= extent_protocol::OK);
+    copied += len;
+    lock.lock();
+    if (ret == extent_protocol::OK && (e = lookup_cache(eid)) != NULL)
+        touch(e, std::max(e->attr.size, (unsigned int)(off + len)));
     return ret;
 }
 
@@ -54,7 +394,248 @@ extent_protocol::status
 extent_client::remove(extent_protocol::extentid_t eid) {
     int r = 0;
     extent_protocol::status ret = extent_protocol::OK;
-    ret = cl->call(extent_protocol::remove, eid, r);
+    {
+        std::lock_guard<std::mutex> lock(mtx);
+        invalidate(eid);
+        epoch++;
+    }
+    calls++;
+    ret = call(extent_protocol::remove, eid, r);
     VERIFY(ret == extent_protocol::OK);
     return ret;
 }
+
+// NOENT and EXIST are answers of the directory operations, not failures.
+// The server changes the parent directory, so its cached copy goes.
+
+/* The attributes of what name refers to come back in the same call,
+ * for the getattr that usually follows a lookup. */
+extent_protocol::status
+extent_client::lookup(extent_protocol::extentid_t parent, std::string name,
+                      extent_protocol::extentid_t &eid) {
+    std::vector<extent_protocol::op> ops(2);
+    std::vector<extent_protocol::op_result> results;
+    extent_protocol::status ret;
+
+    ops[0].proc = extent_protocol::lookup;
+    ops[0].id = parent;
+    ops[0].name = name;
+    ops[1].proc = extent_protocol::getattr;
+    ops[1].id = 0;
+    std::unique_lock<std::mutex> lock(mtx);
+    uint64_t seen = epoch;
+    lock.unlock();
+    ret = call_compound(ops, results);
+    lock.lock();
+    if (ret == extent_protocol::OK) {
+        eid = results[0].id;
+        if (epoch == seen)
+            cache_attr(eid, results[1].a);
+    }
+    return ret;
+}
+
+extent_protocol::status
+extent_client::add_entry(extent_protocol::extentid_t parent, std::string name,
+                         extent_protocol::extentid_t eid) {
+    int r;
+    extent_protocol::status ret = extent_protocol::OK;
+    {
+        std::lock_guard<std::mutex> lock(mtx);
+        invalidate(parent);
+        epoch++;
+    }
+    calls++;
+    ret = call(extent_protocol::add_entry, parent, name, eid, r);
+    VERIFY(ret >= extent_protocol::OK);
+    return ret;
+}
+
+extent_protocol::status
+extent_client::remove_entry(extent_protocol::extentid_t parent, std::string name,
+                            extent_protocol::extentid_t &eid) {
+    extent_protocol::status ret = extent_protocol::OK;
+    std::unique_lock<std::mutex> lock(mtx);
+    invalidate(parent);
+    epoch++;
+    lock.unlock();
+    calls++;
+    ret = call(extent_protocol::remove_entry, parent, name, eid);
+    VERIFY(ret >= extent_protocol::OK);
+    lock.lock();
+    if (ret == extent_protocol::OK)
+        invalidate(eid);
+    return ret;
+}
+
+/* Like lookup, the attributes of the new extent come back too. */
+extent_protocol::status
+extent_client::create_entry(extent_protocol::extentid_t parent, uint32_t type,
+                            std::string name, std::string buf,
+                            extent_protocol::extentid_t &eid) {
+    std::vector<extent_protocol::op> ops(2);
+    std::vector<extent_protocol::op_result> results;
+    extent_protocol::status ret;
+
+    ops[0].proc = extent_protocol::create_entry;
+    ops[0].id = parent;
+    ops[0].type = type;
+    ops[0].name = name;
+    ops[0].buf = buf;
+    ops[1].proc = extent_protocol::getattr;
+    ops[1].id = 0;
+    std::unique_lock<std::mutex> lock(mtx);
+    invalidate(parent);
+    uint64_t seen = ++epoch;
+    lock.unlock();
+    ret = call_compound(ops, results);
+    lock.lock();
+    if (ret == extent_protocol::OK) {
+        eid = results[0].id;
+        invalidate(eid);
+        if (epoch == seen)
+            cache_attr(eid, results[1].a);
+    }
+    return ret;
+}
+
+extent_protocol::status
+extent_client::readdir(extent_protocol::extentid_t dir, unsigned long long cookie,
+                       unsigned int max, std::vector<extent_protocol::dirent> &entries) {
+    extent_protocol::status ret;
+    std::unique_lock<std::mutex> lock(mtx);
+    uint64_t seen = epoch;
+    lock.unlock();
+    calls++;
+    ret = call(extent_protocol::readdir, dir, cookie, max, entries);
+    VERIFY(ret >= extent_protocol::OK);
+    lock.lock();
+    if (ret == extent_protocol::OK && epoch == seen) {
+        for (size_t i = 0; i < entries.size(); ++i)
+            cache_attr(entries[i].id, entries[i].a);
+    }
+    return ret;
+}
+
+bool
+extent_client::cached(extent_protocol::extentid_t eid) {
+    std::lock_guard<std::mutex> lock(mtx);
+    cached_extent *e = lookup_cache(eid);
+    return e && e->has_data;
+}
+
+extent_protocol::status
+extent_client::flush(extent_protocol::extentid_t eid) {
+    std::lock_guard<std::mutex> lock(mtx);
+    std::map<extent_protocol::extentid_t, cached_extent>::iterator it = cache.find(eid);
+    if (it == cache.end())
+        return extent_protocol::OK;
+    return write_back(eid, &it->second);
+}
+
+extent_protocol::status
+extent_client::flush() {
+    std::lock_guard<std::mutex> lock(mtx);
+    return flush_all();
+}
+
+/* Every dirty extent is written back, EXTENT_COMPOUND_MAX to a
+ * compound call. The server stops at the first op that fails; the
+ * extents of that op and of the ones after it stay dirty, and its
+ * error is returned. */
+extent_protocol::status
+extent_client::flush_all() {
+    std::vector<extent_protocol::op> ops;
+    std::vector<cached_extent *> written;
+    std::map<extent_protocol::extentid_t, cached_extent>::iterator it;
+    for (it = cache.begin(); it != cache.end(); ++it) {
+        extent_protocol::op o;
+        if (write_back_op(it->first, &it->second, o)) {
+            ops.push_back(o);
+            written.push_back(&it->second);
+        }
+    }
+    for (size_t i = 0; i < ops.size(); i += EXTENT_COMPOUND_MAX) {
+        size_t n = std::min(ops.size() - i, (size_t)EXTENT_COMPOUND_MAX);
+        std::vector<extent_protocol::op> batch(ops.begin() + i, ops.begin() + i + n);
+        std::vector<cached_extent *> batch_written(written.begin() + i, written.begin() + i + n);
+        std::vector<extent_protocol::op_result> results;
+        extent_protocol::status ret = call_compound(batch, results);
+        ret = took(batch_written, results, ret);
+        if (ret != extent_protocol::OK)
+            return ret;
+    }
+    return extent_protocol::OK;
+}
+
+/* Mark the extents the write-back ops of a compound call were for,
+ * in order, clean as far as the server took the ops, and return the
+ * status of the write-backs. */
+extent_protocol::status
+extent_client::took(const std::vector<cached_extent *> &written,
+                    const std::vector<extent_protocol::op_result> &results,
+                    extent_protocol::status ret) {
+    for (size_t i = 0; i < written.size(); ++i) {
+        if (i >= results.size())
+            return ret != extent_protocol::OK ? ret : extent_protocol::IOERR;
+        if (results[i].ret != extent_protocol::OK)
+            return results[i].ret;
+        written_back(written[i]);
+    }
+    return extent_protocol::OK;
+}
+
+/* The cached writes to the extents ops use go first, in the same call
+ * if it has room for them, which then holds mtx; if the server fails
+ * one of them, none of ops is done. What the ops change is dropped
+ * from the cache. */
+extent_protocol::status
+extent_client::compound(const std::vector<extent_protocol::op> &ops,
+                        std::vector<extent_protocol::op_result> &results) {
+    std::vector<extent_protocol::op> all;
+    std::vector<extent_protocol::op_result> all_results;
+    std::vector<cached_extent *> written;
+    extent_protocol::status ret;
+
+    std::unique_lock<std::mutex> lock(mtx);
+    uint64_t seen = ++epoch;
+    bool apart = 2 * ops.size() > EXTENT_COMPOUND_MAX;
+    for (size_t i = 0; i < ops.size(); ++i) {
+        std::map<extent_protocol::extentid_t, cached_extent>::iterator it = cache.find(ops[i].id);
+        extent_protocol::op o;
+        if (it == cache.end())
+            continue;
+        if (apart) {
+            if ((ret = write_back(it->first, &it->second)) != extent_protocol::OK)
+                return ret;
+        } else if (write_back_op(it->first, &it->second, o)) {
+            all.push_back(o);
+            written.push_back(&it->second);
+        }
+    }
+    size_t skip = all.size();
+    all.insert(all.end(), ops.begin(), ops.end());
+    if (skip == 0)
+        lock.unlock();
+    ret = call_compound(all, all_results);
+    if (skip == 0)
+        lock.lock();
+    else if (took(written, all_results, ret) != extent_protocol::OK)
+        return ret != extent_protocol::OK ? ret : extent_protocol::IOERR;
+    for (size_t i = skip; i < all_results.size(); ++i) {
+        int proc = all[i].proc;
+        if (proc != extent_protocol::get && proc != extent_protocol::getattr
+            && proc != extent_protocol::read && proc != extent_protocol::lookup) {
+            forget(all[i].id);
+            forget(all_results[i].id);
+        }
+    }
+    for (size_t i = skip; i < all_results.size(); ++i) {
+        if (epoch == seen && all[i].proc == extent_protocol::getattr
+            && all_results[i].ret == extent_protocol::OK)
+            cache_attr(all_results[i].id, all_results[i].a);
+    }
+    if (all_results.size() > skip)
+        results.assign(all_results.begin() + skip, all_results.end());
+    return ret;
+}
@@ -3,26 +3,146 @@
 #ifndef extent_client_h
 #define extent_client_h
 
+#include <atomic>
+#include <chrono>
 #include <cstdint>
+#include <map>
+#include <mutex>
 #include <string>
+#include <thread>
+#include <vector>
 #include "extent_protocol.h"
 #include "extent_server.h"
 
+// The client caches the attributes and, for extents of up to
+// EXTENT_CACHE_DATA bytes, the contents it fetches. A cached extent is
+// trusted for the lease it was fetched under, lease_ms milliseconds,
+// and fetched again after that; 0 turns the cache off. Writes to a
+// cached extent stay in the cache until flush, the end of its lease,
+// or eviction write them back.
+//
+// Calls may come from several threads. mtx guards the cache and is not
+// held over a call to the server, except over the calls that carry
+// cached writes (write-back, flush, eviction, and a compound call with
+// writes to its extents still cached): a cached extent stays dirty
+// until the server has taken its writes, and must not change while
+// they are on the way. epoch counts the changes this client sends, so
+// what a call fetched is not cached if a change may have overtaken it.
+#define EXTENT_LEASE_MS   1000
+#define EXTENT_CACHE_DATA (64*1024)
+#define EXTENT_CACHE_SIZE 1024   // extents
+
+// A replicated extent server answers RPCERR when no raft leader took
+// the call, which is then made again after EXTENT_RETRY_MS.
+#define EXTENT_RETRY_MS   100
+
+// Told about extents another client changed, as far as this client
+// notices: only when it fetches the attributes of an extent again after
+// the lease ran out, and they differ from the old ones. The server does
+// not call back, so a change to an extent not fetched again goes unseen.
+class extent_watcher {
+public:
+    virtual ~extent_watcher() {}
+    virtual void changed(extent_protocol::extentid_t eid) = 0;
+};
+
 class extent_client {
 private:
     rpcc *cl;
 
+    typedef std::chrono::steady_clock clock;
+    struct cached_extent {
+        clock::time_point expires;
+        bool has_attr;
+        extent_protocol::attr attr;
+        bool has_data;
+        std::string data;
+        bool dirty;
+        bool truncated;          // written back with put, not write
+        uint32_t dirty_from;     // dirty byte range otherwise
+        uint32_t dirty_to;
+        bool stale;              // lease ran out, stale_attr are the old attributes
+        extent_protocol::attr stale_attr;
+    };
+    std::map<extent_protocol::extentid_t, cached_extent> cache;
+    std::chrono::milliseconds lease;
+    extent_watcher *watcher;
+    std::mutex mtx;
+    uint64_t epoch;
+
+    template<class... Args>
+    int call(unsigned int proc, Args&&... args) {
+        int ret;
+        while ((ret = cl->call(proc, args...)) == extent_protocol::RPCERR)
+            std::this_thread::sleep_for(std::chrono::milliseconds(EXTENT_RETRY_MS));
+        return ret;
+    }
+    cached_extent *lookup_cache(extent_protocol::extentid_t eid);
+    cached_extent *insert_cache(extent_protocol::extentid_t eid);
+    void invalidate(extent_protocol::extentid_t eid);
+    void forget(extent_protocol::extentid_t eid);
+    extent_protocol::status write_back(extent_protocol::extentid_t eid, cached_extent *e);
+    bool write_back_op(extent_protocol::extentid_t eid, cached_extent *e,
+                       extent_protocol::op &o);
+    void written_back(cached_extent *e);
+    extent_protocol::status took(const std::vector<cached_extent *> &written,
+                                 const std::vector<extent_protocol::op_result> &results,
+                                 extent_protocol::status ret);
+    extent_protocol::status call_compound(const std::vector<extent_protocol::op> &ops,
+                                          std::vector<extent_protocol::op_result> &results);
+    void touch(cached_extent *e, uint32_t size);
+    void cache_attr(extent_protocol::extentid_t eid, const extent_protocol::attr &a);
+    void cache_data(extent_protocol::extentid_t eid, std::string &data, uint64_t seen,
+                    bool keep);
+    extent_protocol::status flush_all();
+
 public:
-    extent_client(std::string dst);
+    extent_client(std::string dst, int lease_ms = EXTENT_LEASE_MS);
+    ~extent_client();
 
     extent_protocol::status create(uint32_t type,  extent_protocol::extentid_t &eid);
     extent_protocol::status get(extent_protocol::extentid_t eid,
                                 std::string &buf);
+    extent_protocol::status read(extent_protocol::extentid_t eid, unsigned int off,
+                                 unsigned int len, std::string &buf);
     extent_protocol::status getattr(extent_protocol::extentid_t eid,
                                     extent_protocol::attr &a);
     extent_protocol::status put(extent_protocol::extentid_t eid, std::string buf);
+    extent_protocol::status write(extent_protocol::extentid_t eid, unsigned int off,
+                                  std::string buf);
+    extent_protocol::status write(extent_protocol::extentid_t eid, unsigned int off,
+                                  const char *data, size_t len);
     extent_protocol::status remove(extent_protocol::extentid_t eid);
 
+    // directory operations, done by the extent server in one call
+    extent_protocol::status lookup(extent_protocol::extentid_t parent,
+                                   std::string name, extent_protocol::extentid_t &eid);
+    extent_protocol::status add_entry(extent_protocol::extentid_t parent,
+                                      std::string name, extent_protocol::extentid_t eid);
+    extent_protocol::status remove_entry(extent_protocol::extentid_t parent,
+                                         std::string name, extent_protocol::extentid_t &eid);
+    extent_protocol::status create_entry(extent_protocol::extentid_t parent, uint32_t type,
+                                         std::string name, std::string buf,
+                                         extent_protocol::extentid_t &eid);
+    // a batch of entries; their attributes are cached for the stats
+    // that usually follow a listing
+    extent_protocol::status readdir(extent_protocol::extentid_t dir,
+                                    unsigned long long cookie, unsigned int max,
+                                    std::vector<extent_protocol::dirent> &entries);
+
+    void set_watcher(extent_watcher *w) { watcher = w; }
+    // whether the contents of eid are cached
+    bool cached(extent_protocol::extentid_t eid);
+
+    // at most EXTENT_COMPOUND_MAX ops in one call, see extent_server::compound
+    extent_protocol::status compound(const std::vector<extent_protocol::op> &ops,
+                                     std::vector<extent_protocol::op_result> &results);
+
+    // write back the cached writes to eid, or to every extent
+    extent_protocol::status flush(extent_protocol::extentid_t eid);
+    extent_protocol::status flush();
+    std::atomic<uint64_t> calls;   // sent to the extent server
+    std::atomic<uint64_t> copied;  // file bytes copied in memory
 };
 
 #endif
@@ -5,17 +5,29 @@
 
 #include "rpc.h"
 
+// The most ops one compound call may hold; the server runs them as one
+// operation on its disk, which must fit the journal whole.
+#define EXTENT_COMPOUND_MAX 8
+
 class extent_protocol {
  public:
   typedef int status;
   typedef unsigned long long extentid_t;
-  enum xxstatus { OK, RPCERR, NOENT, IOERR };
+  enum xxstatus { OK, RPCERR, NOENT, IOERR, EXIST };
   enum rpc_numbers {
     put = 0x6001,
     get,
     getattr,
     remove,
-    create
+    create,
+    read,
+    write,
+    lookup,
+    add_entry,
+    remove_entry,
+    create_entry,
+    compound,
+    readdir
   };
 
   //add the new file type symlink.
@@ -32,6 +44,47 @@ class extent_protocol {
     unsigned int ctime;
     unsigned int size;
   };
+
+  // Bytes that go on the wire like a std::string, straight from where
+  // they are, without a string to copy them into first.
+  struct bytes {
+    const char *data = NULL;
+    size_t size = 0;
+  };
+
+  // One step of a compound call: the call numbered proc, with the
+  // arguments of that call taken from the fields it has. An id of 0
+  // names the extent the step before returned, so a file can be
+  // created and filled in one compound. A sender may point data at
+  // the bytes to send instead of copying them into buf; they arrive
+  // in buf.
+  struct op {
+    int proc;
+    extentid_t id;
+    uint32_t type;
+    unsigned int off;
+    unsigned int len;
+    std::string name;
+    std::string buf;
+    bytes data;
+  };
+
+  struct op_result {
+    status ret;
+    extentid_t id;
+    std::string buf;
+    attr a;
+  };
+
+  // An entry readdir returns, with the attributes of what it names so
+  // a listing needs no getattr per entry. cookie is where the next
+  // readdir starts to go on after it.
+  struct dirent {
+    std::string name;
+    extentid_t id;
+    unsigned long long cookie;
+    attr a;
+  };
 };
 
 inline unmarshall &
@@ -56,4 +109,81 @@ operator<<(marshall &m, extent_protocol::attr a)
   return m;
 }
 
+inline unmarshall &
+operator>>(unmarshall &u, extent_protocol::op &o)
+{
+  u >> o.proc;
+  u >> o.id;
+  u >> o.type;
+  u >> o.off;
+  u >> o.len;
+  u >> o.name;
+  u >> o.buf;
+  return u;
+}
+
+inline marshall &
+operator<<(marshall &m, extent_protocol::bytes b)
+{
+  m << (unsigned int) b.size;
+  m.rawbytes(b.data, b.size);
+  return m;
+}
+
+inline marshall &
+operator<<(marshall &m, const extent_protocol::op &o)
+{
+  m << o.proc;
+  m << o.id;
+  m << o.type;
+  m << o.off;
+  m << o.len;
+  m << o.name;
+  if (o.data.data)
+    m << o.data;
+  else
+    m << o.buf;
+  return m;
+}
+
+inline unmarshall &
+operator>>(unmarshall &u, extent_protocol::op_result &r)
+{
+  u >> r.ret;
+  u >> r.id;
+  u >> r.buf;
+  u >> r.a;
+  return u;
+}
+
+inline marshall &
+operator<<(marshall &m, extent_protocol::op_result r)
+{
+  m << r.ret;
+  m << r.id;
+  m << r.buf;
+  m << r.a;
+  return m;
+}
+
+inline unmarshall &
+operator>>(unmarshall &u, extent_protocol::dirent &d)
+{
+  u >> d.name;
+  u >> d.id;
+  u >> d.cookie;
+  u >> d.a;
+  return u;
+}
+
+inline marshall &
+operator<<(marshall &m, extent_protocol::dirent d)
+{
+  m << d.name;
+  m << d.id;
+  m << d.cookie;
+  m << d.a;
+  return m;
+}
+
 #endif 
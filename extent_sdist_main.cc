@@ -8,11 +8,41 @@
 
 // Main loop of extent server raft group
 
+static void usage(const char *prog) {
+    fprintf(stderr, "Usage: %s [-i] [-b block-size] [-s disk-MB] [-n inodes] port\n", prog);
+    exit(1);
+}
+
 int main(int argc, char *argv[]) {
     int count = 0;
+    int ch;
+    bool images = false;
+    uint32_t bsize = BLOCK_SIZE, disk_mb = DISK_SIZE >> 20, inodes = INODE_NUM;
 
-    if (argc != 2) {
-        fprintf(stderr, "Usage: %s port\n", argv[0]);
+    // -i keeps every node's disk in an image file next to its raft log,
+    // in raft_temp/raft_storage_N; a restart keeps raft_temp and resumes
+    // from the logs and images in it. Without -i the disks live in
+    // memory and raft_temp is wiped at every start. The geometry
+    // applies to every node's disk; an existing image keeps its own.
+    while ((ch = getopt(argc, argv, "ib:s:n:")) != -1) {
+        switch (ch) {
+        case 'i': images = true; break;
+        case 'b': bsize = atoi(optarg); break;
+        case 's': disk_mb = atoi(optarg); break;
+        case 'n': inodes = atoi(optarg); break;
+        default: usage(argv[0]);
+        }
+    }
+    if (argc - optind != 1) {
+        usage(argv[0]);
+    }
+    if (disk_mb == 0 || disk_mb > 4095) {
+        fprintf(stderr, "disk size must be 1 to 4095 MB\n");
+        exit(1);
+    }
+    disk_geometry geo(bsize, disk_mb << 20, inodes);
+    if (!geo.valid()) {
+        fprintf(stderr, "bad disk geometry: %u byte blocks, %u MB, %u inodes\n", bsize, disk_mb, inodes);
         exit(1);
     }
 
@@ -23,16 +53,24 @@ int main(int argc, char *argv[]) {
         count = atoi(count_env);
     }
 
-    rpcs server(atoi(argv[1]), count);
-    extent_server_dist es_rg(3); // extent server for raft group
+    rpcs server(atoi(argv[optind]), count);
+    extent_server_dist es_rg(3, images, geo); // extent server for raft group
 
     // You can not change or add the rpc interfaces
-    printf("extent server dist started at port %d\n", atoi(argv[1]));
+    printf("extent server dist started at port %d\n", atoi(argv[optind]));
     server.reg(extent_protocol::get, &es_rg, &extent_server_dist::get);
     server.reg(extent_protocol::getattr, &es_rg, &extent_server_dist::getattr);
     server.reg(extent_protocol::put, &es_rg, &extent_server_dist::put);
     server.reg(extent_protocol::remove, &es_rg, &extent_server_dist::remove);
     server.reg(extent_protocol::create, &es_rg, &extent_server_dist::create);
+    server.reg(extent_protocol::read, &es_rg, &extent_server_dist::read);
+    server.reg(extent_protocol::write, &es_rg, &extent_server_dist::write);
+    server.reg(extent_protocol::lookup, &es_rg, &extent_server_dist::lookup);
+    server.reg(extent_protocol::add_entry, &es_rg, &extent_server_dist::add_entry);
+    server.reg(extent_protocol::remove_entry, &es_rg, &extent_server_dist::remove_entry);
+    server.reg(extent_protocol::create_entry, &es_rg, &extent_server_dist::create_entry);
+    server.reg(extent_protocol::compound, &es_rg, &extent_server_dist::compound);
+    server.reg(extent_protocol::readdir, &es_rg, &extent_server_dist::readdir);
 
     while (1)
         sleep(1000);
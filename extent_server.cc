@@ -1,6 +1,7 @@
 // the extent server implementation
 
 #include "extent_server.h"
+#include "directory.h"
 #include <sstream>
 #include <stdio.h>
 #include <stdlib.h>
@@ -9,13 +10,38 @@
 #include <sys/stat.h>
 #include <fcntl.h>
 
-extent_server::extent_server() 
+// A directory file read and written straight through the inode layer.
+class inode_dir_io : public directory::io {
+  inode_manager *im;
+  uint32_t inum;
+public:
+  inode_dir_io(inode_manager *m, uint32_t i) : im(m), inum(i) {}
+  extent_protocol::status read(uint32_t b, std::string &block) {
+    char *cbuf = NULL;
+    int size = 0;
+    im->read_file_range(inum, b * DIR_BLOCK, DIR_BLOCK, &cbuf, &size);
+    block.assign(cbuf ? cbuf : "", size);
+    free(cbuf);
+    return extent_protocol::OK;
+  }
+  extent_protocol::status write(uint32_t b, const std::string &block) {
+    return im->write_file_range(inum, b * DIR_BLOCK, block.data(), block.size());
+  }
+};
+
+extent_server::extent_server(const char *image, const disk_geometry &geo)
+{
+  im = new inode_manager(image, geo);
+}
+
+extent_server::~extent_server()
 {
-  im = new inode_manager();
+  delete im;
 }
 
 int extent_server::create(uint32_t type, extent_protocol::extentid_t &id)
 {
+  std::lock_guard<std::recursive_mutex> lock(mtx);
   // alloc a new inode and return inum
   printf("extent_server: create inode\n");
   id = im->alloc_inode(type);
@@ -25,17 +51,17 @@ int extent_server::create(uint32_t type, extent_protocol::extentid_t &id)
 
 int extent_server::put(extent_protocol::extentid_t id, std::string buf, int &)
 {
+  std::lock_guard<std::recursive_mutex> lock(mtx);
   id &= 0x7fffffff;
   
   const char * cbuf = buf.c_str();
   int size = buf.size();
-  im->write_file(id, cbuf, size);
-  
-  return extent_protocol::OK;
+  return im->write_file(id, cbuf, size);
 }
 
 int extent_server::get(extent_protocol::extentid_t id, std::string &buf)
 {
+  std::lock_guard<std::recursive_mutex> lock(mtx);
   printf("extent_server: get %lld\n", id);
 
   id &= 0x7fffffff;
@@ -54,8 +80,41 @@ int extent_server::get(extent_protocol::extentid_t id, std::string &buf)
   return extent_protocol::OK;
 }
 
+int extent_server::read(extent_protocol::extentid_t id, unsigned int off,
+                        unsigned int len, std::string &buf)
+{
+  std::lock_guard<std::recursive_mutex> lock(mtx);
+  printf("extent_server: read %lld off %u len %u\n", id, off, len);
+
+  id &= 0x7fffffff;
+
+  int size = 0;
+  char *cbuf = NULL;
+
+  im->read_file_range(id, off, len, &cbuf, &size);
+  if (size == 0)
+    buf = "";
+  else {
+    buf.assign(cbuf, size);
+    free(cbuf);
+  }
+
+  return extent_protocol::OK;
+}
+
+int extent_server::write(extent_protocol::extentid_t id, unsigned int off,
+                         std::string buf, int &)
+{
+  std::lock_guard<std::recursive_mutex> lock(mtx);
+  printf("extent_server: write %lld off %u len %lu\n", id, off, buf.size());
+
+  id &= 0x7fffffff;
+  return im->write_file_range(id, off, buf.data(), buf.size());
+}
+
 int extent_server::getattr(extent_protocol::extentid_t id, extent_protocol::attr &a)
 {
+  std::lock_guard<std::recursive_mutex> lock(mtx);
   printf("extent_server: getattr %lld\n", id);
 
   id &= 0x7fffffff;
@@ -70,6 +129,7 @@ int extent_server::getattr(extent_protocol::extentid_t id, extent_protocol::attr
 
 int extent_server::remove(extent_protocol::extentid_t id, int &)
 {
+  std::lock_guard<std::recursive_mutex> lock(mtx);
   printf("extent_server: write %lld\n", id);
 
   id &= 0x7fffffff;
@@ -78,3 +138,205 @@ int extent_server::remove(extent_protocol::extentid_t id, int &)
   return extent_protocol::OK;
 }
 
+int extent_server::lookup(extent_protocol::extentid_t parent, std::string name,
+                          extent_protocol::extentid_t &id)
+{
+  std::lock_guard<std::recursive_mutex> lock(mtx);
+  printf("extent_server: lookup %s in %lld\n", name.c_str(), parent);
+
+  parent &= 0x7fffffff;
+  inode_dir_io io(im, parent);
+  uint32_t inum = 0;
+  int r = directory(&io).lookup(name, inum);
+  id = inum;
+
+  return r;
+}
+
+int extent_server::add_entry(extent_protocol::extentid_t parent, std::string name,
+                             extent_protocol::extentid_t id, int &)
+{
+  std::lock_guard<std::recursive_mutex> lock(mtx);
+  printf("extent_server: add %s -> %lld to %lld\n", name.c_str(), id, parent);
+
+  parent &= 0x7fffffff;
+  inode_dir_io io(im, parent);
+  im->begin_op();
+  int r = directory(&io).add(name, id & 0x7fffffff);
+  im->end_op();
+
+  return r;
+}
+
+/* Unlink name from parent and remove the file it named; chfs has no
+ * hard links, so the entry was the only reference. */
+int extent_server::remove_entry(extent_protocol::extentid_t parent, std::string name,
+                                extent_protocol::extentid_t &id)
+{
+  std::lock_guard<std::recursive_mutex> lock(mtx);
+  printf("extent_server: remove %s from %lld\n", name.c_str(), parent);
+
+  parent &= 0x7fffffff;
+  inode_dir_io io(im, parent);
+  uint32_t inum = 0;
+  im->begin_op();
+  int r = directory(&io).remove(name, inum);
+  if (r == extent_protocol::OK)
+    im->remove_file(inum);
+  im->end_op();
+  id = inum;
+
+  return r;
+}
+
+/* Create a file of type holding buf and link it into parent as name,
+ * unless the name is taken. */
+int extent_server::create_entry(extent_protocol::extentid_t parent, uint32_t type,
+                                std::string name, std::string buf,
+                                extent_protocol::extentid_t &id)
+{
+  std::lock_guard<std::recursive_mutex> lock(mtx);
+  printf("extent_server: create %s in %lld\n", name.c_str(), parent);
+
+  parent &= 0x7fffffff;
+  inode_dir_io io(im, parent);
+  directory dir(&io);
+  uint32_t inum = 0;
+  int r = dir.lookup(name, inum);
+  if (r != extent_protocol::NOENT) {
+    id = inum;
+    return r == extent_protocol::OK ? extent_protocol::EXIST : r;
+  }
+
+  im->begin_op();
+  inum = im->alloc_inode(type);
+  r = extent_protocol::OK;
+  if (!buf.empty())
+    r = im->write_file(inum, buf.data(), buf.size());
+  if (r == extent_protocol::OK)
+    r = dir.add(name, inum);
+  if (r != extent_protocol::OK) {
+    im->remove_file(inum);
+    inum = 0;
+  }
+  im->end_op();
+  id = inum;
+
+  return r;
+}
+
+/* Run ops in order as one operation on the disk, up to the first one
+ * that does not return OK, whose status is returned; results has an
+ * entry for every op run. add_entry links the extent in off. At most
+ * EXTENT_COMPOUND_MAX ops, so the operation fits the journal. */
+int extent_server::compound(std::vector<extent_protocol::op> ops,
+                            std::vector<extent_protocol::op_result> &results)
+{
+  std::lock_guard<std::recursive_mutex> lock(mtx);
+  printf("extent_server: compound of %lu\n", ops.size());
+  if (ops.size() > EXTENT_COMPOUND_MAX) {
+    printf("extent_server: compound of more than %d ops\n", EXTENT_COMPOUND_MAX);
+    return extent_protocol::IOERR;
+  }
+
+  int r = extent_protocol::OK;
+  extent_protocol::extentid_t last = 0;
+  im->begin_op();
+  for (size_t i = 0; i < ops.size() && r == extent_protocol::OK; ++i) {
+    const extent_protocol::op &o = ops[i];
+    extent_protocol::op_result res;
+    int unused;
+    res.id = o.id ? o.id : last;
+    memset(&res.a, 0, sizeof(res.a));
+    switch (o.proc) {
+    case extent_protocol::put:
+      r = put(res.id, o.buf, unused);
+      break;
+    case extent_protocol::get:
+      r = get(res.id, res.buf);
+      break;
+    case extent_protocol::getattr:
+      r = getattr(res.id, res.a);
+      break;
+    case extent_protocol::remove:
+      r = remove(res.id, unused);
+      break;
+    case extent_protocol::create:
+      r = create(o.type, res.id);
+      break;
+    case extent_protocol::read:
+      r = read(res.id, o.off, o.len, res.buf);
+      break;
+    case extent_protocol::write:
+      r = write(res.id, o.off, o.buf, unused);
+      break;
+    case extent_protocol::lookup:
+      r = lookup(res.id, o.name, res.id);
+      break;
+    case extent_protocol::add_entry:
+      r = add_entry(res.id, o.name, o.off, unused);
+      break;
+    case extent_protocol::remove_entry:
+      r = remove_entry(res.id, o.name, res.id);
+      break;
+    case extent_protocol::create_entry:
+      r = create_entry(res.id, o.type, o.name, o.buf, res.id);
+      break;
+    default:
+      printf("extent_server: bad compound op %d\n", o.proc);
+      r = extent_protocol::IOERR;
+    }
+    res.ret = r;
+    results.push_back(res);
+    last = res.id;
+  }
+  im->end_op();
+
+  return r;
+}
+
+int extent_server::readdir(extent_protocol::extentid_t dir, unsigned long long cookie,
+                           unsigned int max, std::vector<extent_protocol::dirent> &entries)
+{
+  std::lock_guard<std::recursive_mutex> lock(mtx);
+  printf("extent_server: readdir %lld from %llx\n", dir, cookie);
+
+  dir &= 0x7fffffff;
+  inode_dir_io io(im, dir);
+  std::vector<directory::entry> list;
+  int r = directory(&io).list(cookie, max, list);
+  entries.resize(list.size());
+  for (size_t i = 0; i < list.size(); ++i) {
+    entries[i].name = list[i].name;
+    entries[i].id = list[i].inum;
+    entries[i].cookie = list[i].cookie;
+    memset(&entries[i].a, 0, sizeof(entries[i].a));
+    im->get_attr(list[i].inum, entries[i].a);
+  }
+
+  return r;
+}
+
+void extent_server::begin_op()
+{
+  mtx.lock();
+  im->begin_op();
+}
+
+void extent_server::end_op()
+{
+  im->end_op();
+  mtx.unlock();
+}
+
+uint32_t extent_server::log_index()
+{
+  std::lock_guard<std::recursive_mutex> lock(mtx);
+  return im->get_log_index();
+}
+
+void extent_server::set_log_index(uint32_t index)
+{
+  std::lock_guard<std::recursive_mutex> lock(mtx);
+  im->set_log_index(index);
+}
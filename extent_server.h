@@ -5,9 +5,15 @@
 
 #include <string>
 #include <map>
+#include <mutex>
+#include <vector>
 #include "extent_protocol.h"
 #include "inode_manager.h"
 
+// Each call is one operation on the disk. With a disk image it is
+// answered before its journal group commits, so a crash can lose the
+// last JOURNAL_GROUP calls (or JOURNAL_GROUP_SECS of them), though
+// never part of one.
 class extent_server {
  protected:
 #if 0
@@ -18,15 +24,50 @@ class extent_server {
   std::map <extent_protocol::extentid_t, extent_t> extents;
 #endif
   inode_manager *im;
+  // rpcs dispatches calls from several threads; compound calls the
+  // other operations with it held
+  std::recursive_mutex mtx;
 
  public:
-  extent_server();
+  extent_server(const char *image = NULL,
+                const disk_geometry &geo = disk_geometry());
+  ~extent_server();
 
   int create(uint32_t type, extent_protocol::extentid_t &id);
   int put(extent_protocol::extentid_t id, std::string, int &);
   int get(extent_protocol::extentid_t id, std::string &);
+  int read(extent_protocol::extentid_t id, unsigned int off, unsigned int len, std::string &);
+  int write(extent_protocol::extentid_t id, unsigned int off, std::string, int &);
   int getattr(extent_protocol::extentid_t id, extent_protocol::attr &);
   int remove(extent_protocol::extentid_t id, int &);
+
+  // Directory operations, each one round trip and one operation on
+  // the disk. They return NOENT or EXIST like directory does.
+  int lookup(extent_protocol::extentid_t parent, std::string name,
+             extent_protocol::extentid_t &id);
+  int add_entry(extent_protocol::extentid_t parent, std::string name,
+                extent_protocol::extentid_t id, int &);
+  int remove_entry(extent_protocol::extentid_t parent, std::string name,
+                   extent_protocol::extentid_t &id);
+  int create_entry(extent_protocol::extentid_t parent, uint32_t type,
+                   std::string name, std::string buf,
+                   extent_protocol::extentid_t &id);
+
+  int compound(std::vector<extent_protocol::op> ops,
+               std::vector<extent_protocol::op_result> &results);
+
+  // Up to max entries of dir from cookie on, 0 for the first; fewer
+  // means the end. See directory::list.
+  int readdir(extent_protocol::extentid_t dir, unsigned long long cookie,
+              unsigned int max, std::vector<extent_protocol::dirent> &entries);
+
+  // The calls from begin_op to end_op, by the same thread, and the log
+  // index set in between reach the disk as one operation; other
+  // threads wait.
+  void begin_op();
+  void end_op();
+  uint32_t log_index();
+  void set_log_index(uint32_t index);
 };
 
 #endif 
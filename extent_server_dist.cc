@@ -1,12 +1,87 @@
 #include "extent_server_dist.h"
 
-chfs_raft *extent_server_dist::leader() const {
-    int leader = this->raft_group->check_exact_one_leader();
-    if (leader < 0) {
-        return this->raft_group->nodes[0];
-    } else {
-        return this->raft_group->nodes[leader];
+bool extent_server_dist::disk_images = false;
+disk_geometry extent_server_dist::geometry;
+
+template <>
+chfs_state_machine *create_state_machine<chfs_state_machine>(const std::string &storage_dir) {
+    if (!extent_server_dist::disk_images) {
+        return new chfs_state_machine(NULL, extent_server_dist::geometry);
     }
+    return new chfs_state_machine((storage_dir + "/disk.img").c_str(),
+                                  extent_server_dist::geometry);
+}
+
+/* The reachable node that leads in the latest term, -1 if none does. */
+int extent_server_dist::find_leader() const {
+    int leader = -1, leader_term = -1;
+    for (size_t i = 0; i < raft_group->nodes.size(); i++) {
+        int term;
+        if (raft_group->servers[i]->reachable() && raft_group->nodes[i]->is_leader(term)
+            && term > leader_term) {
+            leader = i;
+            leader_term = term;
+        }
+    }
+    return leader;
+}
+
+/* Append cmd to the log of the leader, looking for a new one while the
+ * one known turns it down or leads an older term than one seen before.
+ * false if there was none for LEADER_WAIT_MS; the caller answers RPCERR. */
+bool extent_server_dist::submit(chfs_command_raft &cmd, int &term, int &index) {
+    auto deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(LEADER_WAIT_MS);
+    while (true) {
+        std::unique_lock<std::mutex> lock(leader_mtx);
+        int idx = leader_idx;
+        if (idx < 0 || !raft_group->servers[idx]->reachable()) {
+            lock.unlock();
+            idx = find_leader();
+            lock.lock();
+            leader_idx = idx;
+        }
+        lock.unlock();
+        bool took = idx >= 0 && raft_group->nodes[idx]->new_command(cmd, term, index);
+        lock.lock();
+        if (took) {
+            if (term >= leader_term) {
+                if (term > leader_term)
+                    printf("extent_server_dist: node %d leads term %d\n", idx, term);
+                leader_term = term;
+                return true;
+            }
+            // a leader deposed in a later term that has not heard of it
+            // yet; what it takes never commits
+            printf("extent_server_dist: node %d still leads term %d of %d\n",
+                   idx, term, leader_term);
+        }
+        if (leader_idx == idx)
+            leader_idx = -1;
+        lock.unlock();
+        if (std::chrono::steady_clock::now() >= deadline) {
+            printf("extent_server_dist: no leader\n");
+            return false;
+        }
+        std::this_thread::sleep_for(std::chrono::milliseconds(LEADER_RETRY_MS));
+    }
+}
+
+/* Submit cmd and wait for it to be applied. RPCERR if no leader took
+ * it, or it was not applied within COMMAND_WAIT_MS; the leader known
+ * is looked for again then, in case it lost its office. */
+int extent_server_dist::run(chfs_command_raft &cmd, const char *what) {
+    std::unique_lock<std::mutex> lock(cmd.res->mtx);
+    int term, index;
+    if (!submit(cmd, term, index))
+        return extent_protocol::RPCERR;
+    auto deadline = std::chrono::system_clock::now() + std::chrono::milliseconds(COMMAND_WAIT_MS);
+    if (!cmd.res->cv.wait_until(lock, deadline, [&] { return cmd.res->done; })) {
+        printf("extent_server_dist: %s timed out in term %d\n", what, term);
+        std::lock_guard<std::mutex> leader_lock(leader_mtx);
+        leader_idx = -1;
+        return extent_protocol::RPCERR;
+    }
+    return extent_protocol::OK;
 }
 
 int extent_server_dist::create(uint32_t type, extent_protocol::extentid_t &id) {
@@ -14,86 +89,167 @@ int extent_server_dist::create(uint32_t type, extent_protocol::extentid_t &id) {
     chfs_command_raft cmd;
     cmd.cmd_tp = chfs_command_raft::CMD_CRT;
     cmd.type = type;
-    std::unique_lock<std::mutex> lock(cmd.res->mtx);
-    int term, index;
-    auto now = std::chrono::system_clock::now();
-    leader()->new_command(cmd, term, index);
-    if(!cmd.res->done){
-        std::chrono::milliseconds m1(2000);
-        ASSERT(cmd.res->cv.wait_until(lock, now + m1) == std::cv_status::no_timeout, "extent_server_dist::create command timeout");
-    }
+    int r = run(cmd, "create");
+    if (r != extent_protocol::OK)
+        return r;
     id = cmd.res->id;
     return extent_protocol::OK;
 }
 
 int extent_server_dist::put(extent_protocol::extentid_t id, std::string buf, int &) {
     // Lab3: your code here
-        chfs_command_raft cmd;
+    chfs_command_raft cmd;
     cmd.cmd_tp = chfs_command_raft::CMD_PUT;
     cmd.buf =  buf;
     cmd.id = id;
-    std::unique_lock<std::mutex> lock(cmd.res->mtx);
-    int term, index;
-    auto now = std::chrono::system_clock::now();
-    leader()->new_command(cmd, term, index);
-    if(!cmd.res->done){
-        std::chrono::milliseconds m1(2000);
-        ASSERT(cmd.res->cv.wait_until(lock, now + m1) == std::cv_status::no_timeout, "extent_server_dist::create command timeout");
-    }
-    printf("extent_server_dist: put file ok\n");
-    return extent_protocol::OK;
+    int r = run(cmd, "put");
+    if (r != extent_protocol::OK)
+        return r;
+    return cmd.res->status;
 }
 
 int extent_server_dist::get(extent_protocol::extentid_t id, std::string &buf) {
     // Lab3: your code here
-        chfs_command_raft cmd;
+    chfs_command_raft cmd;
     cmd.cmd_tp = chfs_command_raft::CMD_GET;
     cmd.id = id;
-    std::unique_lock<std::mutex> lock(cmd.res->mtx);
-    int term, index;
-    auto now = std::chrono::system_clock::now();
-    leader()->new_command(cmd, term, index);
-    if(!cmd.res->done){
-        std::chrono::milliseconds m1(2000);
-        ASSERT(cmd.res->cv.wait_until(lock, now + m1) == std::cv_status::no_timeout, "extent_server_dist::create command timeout");
-    }
+    int r = run(cmd, "get");
+    if (r != extent_protocol::OK)
+        return r;
     buf = cmd.res->buf;
     return extent_protocol::OK;
 }
 
+int extent_server_dist::read(extent_protocol::extentid_t id, unsigned int off, unsigned int len, std::string &buf) {
+    chfs_command_raft cmd;
+    cmd.cmd_tp = chfs_command_raft::CMD_READ;
+    cmd.id = id;
+    cmd.off = off;
+    cmd.len = len;
+    int r = run(cmd, "read");
+    if (r != extent_protocol::OK)
+        return r;
+    buf = cmd.res->buf;
+    return extent_protocol::OK;
+}
+
+int extent_server_dist::write(extent_protocol::extentid_t id, unsigned int off, std::string buf, int &) {
+    chfs_command_raft cmd;
+    cmd.cmd_tp = chfs_command_raft::CMD_WRITE;
+    cmd.id = id;
+    cmd.off = off;
+    cmd.buf = buf;
+    int r = run(cmd, "write");
+    if (r != extent_protocol::OK)
+        return r;
+    return cmd.res->status;
+}
+
 int extent_server_dist::getattr(extent_protocol::extentid_t id, extent_protocol::attr &a) {
     // Lab3: your code here
-        chfs_command_raft cmd;
+    chfs_command_raft cmd;
     cmd.cmd_tp = chfs_command_raft::CMD_GETA;
     cmd.id = id;
-    std::unique_lock<std::mutex> lock(cmd.res->mtx);
-    int term, index;
-    auto now = std::chrono::system_clock::now();
-    leader()->new_command(cmd, term, index);
-    if(!cmd.res->done){
-        std::chrono::milliseconds m1(2000);
-        ASSERT(cmd.res->cv.wait_until(lock, now + m1) == std::cv_status::no_timeout, "extent_server_dist::create command timeout");
-    }
+    int r = run(cmd, "getattr");
+    if (r != extent_protocol::OK)
+        return r;
     a = cmd.res->attr;
     return extent_protocol::OK;
 }
 
 int extent_server_dist::remove(extent_protocol::extentid_t id, int &) {
     // Lab3: your code here
-        chfs_command_raft cmd;
+    chfs_command_raft cmd;
     cmd.cmd_tp = chfs_command_raft::CMD_RMV;
     cmd.id = id;
-    std::unique_lock<std::mutex> lock(cmd.res->mtx);
-    int term, index;
-    auto now = std::chrono::system_clock::now();
-    leader()->new_command(cmd, term, index);
-    if(!cmd.res->done){
-        std::chrono::milliseconds m1(2000);
-        ASSERT(cmd.res->cv.wait_until(lock, now + m1) == std::cv_status::no_timeout, "extent_server_dist::create command timeout");
-    }
-    return extent_protocol::OK;
+    return run(cmd, "remove");
+}
+
+int extent_server_dist::lookup(extent_protocol::extentid_t parent, std::string name,
+                                extent_protocol::extentid_t &id) {
+    chfs_command_raft cmd;
+    cmd.cmd_tp = chfs_command_raft::CMD_LOOKUP;
+    cmd.id = parent;
+    cmd.name = name;
+    int r = run(cmd, "lookup");
+    if (r != extent_protocol::OK)
+        return r;
+    id = cmd.res->id;
+    return cmd.res->status;
+}
+
+int extent_server_dist::add_entry(extent_protocol::extentid_t parent, std::string name,
+                                   extent_protocol::extentid_t id, int &) {
+    chfs_command_raft cmd;
+    cmd.cmd_tp = chfs_command_raft::CMD_ADD_ENTRY;
+    cmd.id = parent;
+    cmd.name = name;
+    cmd.off = id;
+    int r = run(cmd, "add_entry");
+    if (r != extent_protocol::OK)
+        return r;
+    return cmd.res->status;
+}
+
+int extent_server_dist::remove_entry(extent_protocol::extentid_t parent, std::string name,
+                                      extent_protocol::extentid_t &id) {
+    chfs_command_raft cmd;
+    cmd.cmd_tp = chfs_command_raft::CMD_RMV_ENTRY;
+    cmd.id = parent;
+    cmd.name = name;
+    int r = run(cmd, "remove_entry");
+    if (r != extent_protocol::OK)
+        return r;
+    id = cmd.res->id;
+    return cmd.res->status;
+}
+
+int extent_server_dist::create_entry(extent_protocol::extentid_t parent, uint32_t type,
+                                      std::string name, std::string buf,
+                                      extent_protocol::extentid_t &id) {
+    chfs_command_raft cmd;
+    cmd.cmd_tp = chfs_command_raft::CMD_CRT_ENTRY;
+    cmd.id = parent;
+    cmd.type = type;
+    cmd.name = name;
+    cmd.buf = buf;
+    int r = run(cmd, "create_entry");
+    if (r != extent_protocol::OK)
+        return r;
+    id = cmd.res->id;
+    return cmd.res->status;
+}
+
+int extent_server_dist::compound(std::vector<extent_protocol::op> ops,
+                                 std::vector<extent_protocol::op_result> &results) {
+    chfs_command_raft cmd;
+    cmd.cmd_tp = chfs_command_raft::CMD_COMPOUND;
+    marshall m;
+    m << ops;
+    cmd.buf = m.str();
+    int r = run(cmd, "compound");
+    if (r != extent_protocol::OK)
+        return r;
+    results = cmd.res->results;
+    return cmd.res->status;
 }
 
 extent_server_dist::~extent_server_dist() {
     delete this->raft_group;
-}
\ No newline at end of file
+}
+
+int extent_server_dist::readdir(extent_protocol::extentid_t dir, unsigned long long cookie,
+                                unsigned int max, std::vector<extent_protocol::dirent> &entries) {
+    chfs_command_raft cmd;
+    cmd.cmd_tp = chfs_command_raft::CMD_READDIR;
+    cmd.id = dir;
+    cmd.off = max;
+    marshall m;
+    m << cookie;
+    cmd.buf = m.str();
+    int r = run(cmd, "readdir");
+    if (r != extent_protocol::OK)
+        return r;
+    entries = cmd.res->entries;
+    return cmd.res->status;
+}
@@ -5,6 +5,7 @@
 
 #include "extent_protocol.h"
 #include <map>
+#include <mutex>
 #include <string>
 #include "raft.h"
 #include "extent_server.h"
@@ -14,20 +15,68 @@
 using chfs_raft = raft<chfs_state_machine, chfs_command_raft>;
 using chfs_raft_group = raft_group<chfs_state_machine, chfs_command_raft>;
 
+// Each node keeps its disk image next to its raft log when disk images
+// are on. raft_temp is then kept across restarts, and every node
+// resumes from its log and image; otherwise it is wiped at start.
+template <>
+chfs_state_machine *create_state_machine<chfs_state_machine>(const std::string &storage_dir);
+
+// Commands go to the leader found last, without asking every node who
+// leads on each call. Only when that node turns a command down, or
+// cannot be reached, are the nodes asked again; a group in the middle
+// of an election is asked every LEADER_RETRY_MS for up to
+// LEADER_WAIT_MS, after which the call fails with RPCERR for the
+// client to make again.
+#define LEADER_RETRY_MS 20
+#define LEADER_WAIT_MS 5000
+
+// A command the leader took but that was not applied within
+// COMMAND_WAIT_MS, say because the leader lost an election meanwhile,
+// fails with RPCERR too.
+#define COMMAND_WAIT_MS 2000
+
 class extent_server_dist {
+    std::mutex leader_mtx;
+    int leader_idx;     // -1 until a leader is found
+    int leader_term;
+
+    int find_leader() const;
+    bool submit(chfs_command_raft &cmd, int &term, int &index);
+    int run(chfs_command_raft &cmd, const char *what);
+
 public:
     chfs_raft_group *raft_group;
-    extent_server_dist(const int num_raft_nodes = 3) {
-        raft_group = new chfs_raft_group(num_raft_nodes);
+    static bool disk_images;
+    static disk_geometry geometry;  // of every node's disk
+    extent_server_dist(const int num_raft_nodes = 3, bool use_disk_images = false,
+                       const disk_geometry &geo = disk_geometry()) {
+        disk_images = use_disk_images;
+        geometry = geo;
+        raft_group = new chfs_raft_group(num_raft_nodes, "raft_temp", use_disk_images);
+        leader_idx = -1;
+        leader_term = 0;
     };
 
-    chfs_raft *leader() const;
-
     int create(uint32_t type, extent_protocol::extentid_t &id);
     int put(extent_protocol::extentid_t id, std::string, int &);
     int get(extent_protocol::extentid_t id, std::string &);
+    int read(extent_protocol::extentid_t id, unsigned int off, unsigned int len, std::string &);
+    int write(extent_protocol::extentid_t id, unsigned int off, std::string, int &);
     int getattr(extent_protocol::extentid_t id, extent_protocol::attr &);
     int remove(extent_protocol::extentid_t id, int &);
+    int lookup(extent_protocol::extentid_t parent, std::string name,
+               extent_protocol::extentid_t &id);
+    int add_entry(extent_protocol::extentid_t parent, std::string name,
+                  extent_protocol::extentid_t id, int &);
+    int remove_entry(extent_protocol::extentid_t parent, std::string name,
+                     extent_protocol::extentid_t &id);
+    int create_entry(extent_protocol::extentid_t parent, uint32_t type,
+                     std::string name, std::string buf,
+                     extent_protocol::extentid_t &id);
+    int compound(std::vector<extent_protocol::op> ops,
+                 std::vector<extent_protocol::op_result> &results);
+    int readdir(extent_protocol::extentid_t dir, unsigned long long cookie,
+                unsigned int max, std::vector<extent_protocol::dirent> &entries);
 
     ~extent_server_dist();
 };
@@ -2,17 +2,44 @@
 #include <arpa/inet.h>
 #include <stdlib.h>
 #include <stdio.h>
+#include <unistd.h>
 #include "extent_server.h"
 
 // Main loop of extent server
 
+static void
+usage(const char *prog)
+{
+  fprintf(stderr, "Usage: %s [-b block-size] [-s disk-MB] [-n inodes] port [disk-image]\n", prog);
+  exit(1);
+}
+
 int
 main(int argc, char *argv[])
 {
   int count = 0;
+  int ch;
+  uint32_t bsize = BLOCK_SIZE, disk_mb = DISK_SIZE >> 20, inodes = INODE_NUM;
 
-  if(argc != 2){
-    fprintf(stderr, "Usage: %s port\n", argv[0]);
+  // the geometry only applies to a new disk; an image keeps its own
+  while((ch = getopt(argc, argv, "b:s:n:")) != -1){
+    switch(ch){
+    case 'b': bsize = atoi(optarg); break;
+    case 's': disk_mb = atoi(optarg); break;
+    case 'n': inodes = atoi(optarg); break;
+    default: usage(argv[0]);
+    }
+  }
+  if(argc - optind != 1 && argc - optind != 2){
+    usage(argv[0]);
+  }
+  if(disk_mb == 0 || disk_mb > 4095){
+    fprintf(stderr, "disk size must be 1 to 4095 MB\n");
+    exit(1);
+  }
+  disk_geometry geo(bsize, disk_mb << 20, inodes);
+  if(!geo.valid()){
+    fprintf(stderr, "bad disk geometry: %u byte blocks, %u MB, %u inodes\n", bsize, disk_mb, inodes);
     exit(1);
   }
 
@@ -23,13 +50,23 @@ main(int argc, char *argv[])
     count = atoi(count_env);
   }
 
-  rpcs server(atoi(argv[1]), count);
-  extent_server ls;
+  rpcs server(atoi(argv[optind]), count);
+  // without an image the file system lives in memory only
+  extent_server ls(argc - optind == 2 ? argv[optind + 1] : NULL, geo);
 
   server.reg(extent_protocol::get, &ls, &extent_server::get);
   server.reg(extent_protocol::getattr, &ls, &extent_server::getattr);
   server.reg(extent_protocol::put, &ls, &extent_server::put);
   server.reg(extent_protocol::remove, &ls, &extent_server::remove);
+  server.reg(extent_protocol::create, &ls, &extent_server::create);
+  server.reg(extent_protocol::read, &ls, &extent_server::read);
+  server.reg(extent_protocol::write, &ls, &extent_server::write);
+  server.reg(extent_protocol::lookup, &ls, &extent_server::lookup);
+  server.reg(extent_protocol::add_entry, &ls, &extent_server::add_entry);
+  server.reg(extent_protocol::remove_entry, &ls, &extent_server::remove_entry);
+  server.reg(extent_protocol::create_entry, &ls, &extent_server::create_entry);
+  server.reg(extent_protocol::compound, &ls, &extent_server::compound);
+  server.reg(extent_protocol::readdir, &ls, &extent_server::readdir);
 
   while(1)
     sleep(1000);
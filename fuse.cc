@@ -15,12 +15,107 @@
 #include <fcntl.h>
 #include <unistd.h>
 #include <arpa/inet.h>
+#include <condition_variable>
+#include <deque>
+#include <map>
+#include <mutex>
+#include <set>
+#include <thread>
+#include <vector>
 #include "lang/verify.h"
 #include "chfs_client.h"
 
 int myid;
 chfs_client *chfs;
 
+// Seconds the kernel may cache attributes and directory entries, set
+// with -t. 0, the default, makes it ask chfs on every access. Changes
+// made by other clients are not pushed to this one, so this is how
+// stale the kernel caches may get.
+double cache_timeout = 0.0;
+
+// Threads serving kernel requests, set with -w. With more than one,
+// a request waiting on the extent server does not hold up the others.
+int workers = 1;
+
+//
+// With kernel caching on, the kernel is told to forget an inode whose
+// attributes chfs_client happens to see change, when it fetches them
+// again after its lease ran out: the attributes and data of the inode
+// and, for a directory, the entries that were looked up in it. The
+// extent server sends no notice of changes, so this only shortens the
+// -t window for inodes this client keeps using; it does not bound it.
+// The notifications go out from their own thread; the kernel may hold
+// locks they need while it waits for the request that found the change.
+//
+class kernel_invalidator : public extent_watcher {
+    struct fuse_chan *ch;
+    std::mutex mtx;
+    std::condition_variable cv;
+    std::deque<fuse_ino_t> changes;
+    std::map<fuse_ino_t, std::set<std::string> > entries;  // by parent
+    void run();
+public:
+    kernel_invalidator(struct fuse_chan *c) : ch(c) {
+        std::thread(&kernel_invalidator::run, this).detach();
+    }
+    void changed(extent_protocol::extentid_t eid);
+    void entry(fuse_ino_t parent, const char *name);
+};
+
+void
+kernel_invalidator::changed(extent_protocol::extentid_t eid)
+{
+    std::lock_guard<std::mutex> lock(mtx);
+    changes.push_back(eid);
+    cv.notify_one();
+}
+
+// The kernel may cache name in parent from now on.
+void
+kernel_invalidator::entry(fuse_ino_t parent, const char *name)
+{
+    std::lock_guard<std::mutex> lock(mtx);
+    entries[parent].insert(name);
+}
+
+void
+kernel_invalidator::run()
+{
+    while (true) {
+        std::unique_lock<std::mutex> lock(mtx);
+        cv.wait(lock, [this] { return !changes.empty(); });
+        fuse_ino_t ino = changes.front();
+        changes.pop_front();
+        std::set<std::string> names;
+        std::map<fuse_ino_t, std::set<std::string> >::iterator it = entries.find(ino);
+        if (it != entries.end()) {
+            names.swap(it->second);
+            entries.erase(it);
+        }
+        lock.unlock();
+
+        printf("invalidate %016lx, %lu entries\n", ino, names.size());
+        fuse_lowlevel_notify_inval_inode(ch, ino, 0, 0);
+        for (std::set<std::string>::iterator n = names.begin(); n != names.end(); ++n)
+            fuse_lowlevel_notify_inval_entry(ch, ino, n->c_str(), n->size());
+    }
+}
+
+kernel_invalidator *invalidator;
+
+//
+// Fill in the timeouts of an entry reply for name in parent.
+//
+void
+entry_timeouts(struct fuse_entry_param *e, fuse_ino_t parent, const char *name)
+{
+    e->attr_timeout = cache_timeout;
+    e->entry_timeout = cache_timeout;
+    if (invalidator)
+        invalidator->entry(parent, name);
+}
+
 int id() { 
     return myid;
 }
@@ -41,47 +136,33 @@ chfs_client::status
 getattr(chfs_client::inum inum, struct stat &st)
 {
     chfs_client::status ret;
+    extent_protocol::attr a;
 
     bzero(&st, sizeof(st));
 
     st.st_ino = inum;
-    printf("getattr %016llx %d\n", inum, chfs->isfile(inum));
-    if(chfs->isfile(inum)){
-        chfs_client::fileinfo info;
-        ret = chfs->getfile(inum, info);
-        if(ret != chfs_client::OK)
-            return ret;
+    // one call for the type and the attributes
+    ret = chfs->getattr(inum, a);
+    if(ret != chfs_client::OK)
+        return ret;
+    st.st_atime = a.atime;
+    st.st_mtime = a.mtime;
+    st.st_ctime = a.ctime;
+    if(a.type == extent_protocol::T_FILE){
         st.st_mode = S_IFREG | 0666;
         st.st_nlink = 1;
-        st.st_atime = info.atime;
-        st.st_mtime = info.mtime;
-        st.st_ctime = info.ctime;
-        st.st_size = info.size;
-        printf("   getattr -> %llu\n", info.size);
-    } else if (chfs->isdir(inum)){
-        chfs_client::dirinfo info;
-        ret = chfs->getdir(inum, info);
-        if(ret != chfs_client::OK)
-            return ret;
+        st.st_size = a.size;
+        printf("getattr %016llx -> %u\n", inum, a.size);
+    } else if (a.type == extent_protocol::T_DIR){
         st.st_mode = S_IFDIR | 0777;
         st.st_nlink = 2;
-        st.st_atime = info.atime;
-        st.st_mtime = info.mtime;
-        st.st_ctime = info.ctime;
-        printf("   getattr -> %lu %lu %lu\n", info.atime, info.mtime, info.ctime);
+        printf("getattr %016llx -> %u %u %u\n", inum, a.atime, a.mtime, a.ctime);
     }
     else{
-        chfs_client::fileinfo info;
-        ret = chfs->getfile(inum, info);
-        if(ret != chfs_client::OK)
-            return ret;
         st.st_mode = S_IFLNK | 0777;
         st.st_nlink = 1;
-        st.st_atime = info.atime;
-        st.st_mtime = info.mtime;
-        st.st_ctime = info.ctime;
-        st.st_size = info.size;
-        printf("   getattr -> link %llu\n", info.size);        
+        st.st_size = a.size;
+        printf("getattr %016llx -> link %u\n", inum, a.size);
     }
     return chfs_client::OK;
 }
@@ -114,7 +195,7 @@ fuseserver_getattr(fuse_req_t req, fuse_ino_t ino,
         fuse_reply_err(req, ENOENT);
         return;
     }
-    fuse_reply_attr(req, &st, 0);
+    fuse_reply_attr(req, &st, cache_timeout);
 }
 
 //
@@ -146,7 +227,7 @@ fuseserver_setattr(fuse_req_t req, fuse_ino_t ino, struct stat *attr,
         chfs->setattr(ino, attr->st_size);
     }
     getattr(ino, st);
-    fuse_reply_attr(req, &st, 0);
+    fuse_reply_attr(req, &st, cache_timeout);
 #else
     fuse_reply_err(req, ENOSYS);
 #endif
@@ -177,7 +258,11 @@ fuseserver_read(fuse_req_t req, fuse_ino_t ino, size_t size,
     std::string buf;
     int r;
     if ((r = chfs->read(ino, size, off, buf)) == chfs_client::OK) {
-        fuse_reply_buf(req, buf.data(), buf.size());
+        // the reply goes out from buf itself, written to the device;
+        // buf is heap memory of a string, not pages splice could move
+        struct fuse_bufvec bufv = FUSE_BUFVEC_INIT(buf.size());
+        bufv.buf[0].mem = (void *) buf.data();
+        fuse_reply_data(req, &bufv, FUSE_BUF_NO_SPLICE);
     }
     else{
         fuse_reply_err(req, ENOENT);
@@ -223,6 +308,43 @@ fuseserver_write(fuse_req_t req, fuse_ino_t ino,
 #endif
 }
 
+//
+// fuseserver_write for the data as libfuse got it. A request read into
+// memory is written from there, like fuseserver_write; one spliced into
+// a pipe (-o splice_read) is copied out of it once.
+//
+void
+fuseserver_write_buf(fuse_req_t req, fuse_ino_t ino,
+        struct fuse_bufvec *bufv, off_t off,
+        struct fuse_file_info *fi)
+{
+    size_t size = fuse_buf_size(bufv);
+    std::string copy;
+    const char *data;
+
+    if (bufv->count == 1 && bufv->idx == 0
+        && !(bufv->buf[0].flags & FUSE_BUF_IS_FD)) {
+        data = (const char *) bufv->buf[0].mem + bufv->off;
+    } else {
+        copy.resize(size);
+        struct fuse_bufvec dst = FUSE_BUFVEC_INIT(size);
+        dst.buf[0].mem = &copy[0];
+        ssize_t n = fuse_buf_copy(&dst, bufv, (enum fuse_buf_copy_flags) 0);
+        if (n < 0) {
+            fuse_reply_err(req, -n);
+            return;
+        }
+        size = n;
+        data = copy.data();
+    }
+    if (chfs->write(ino, size, off, data, size) == chfs_client::OK){
+        fuse_reply_write(req, size);
+    }
+    else{
+        fuse_reply_err(req, ENOENT);
+    }
+}
+
 //
 // Create file @name in directory @parent. 
 //
@@ -246,9 +368,8 @@ fuseserver_createhelper(fuse_ino_t parent, const char *name,
         mode_t mode, struct fuse_entry_param *e, int type)
 {
     int ret;
-    // In chfs, timeouts are always set to 0.0, and generations are always set to 0
-    e->attr_timeout = 0.0;
-    e->entry_timeout = 0.0;
+    // In chfs, generations are always set to 0
+    entry_timeouts(e, parent, name);
     e->generation = 0;
 
     chfs_client::inum inum;
@@ -259,6 +380,7 @@ fuseserver_createhelper(fuse_ino_t parent, const char *name,
     if (ret != chfs_client::OK)
         return ret;
     e->ino = inum;
+    // the attributes came back with the create, see extent_client
     ret = getattr(inum, e->attr);
     return ret;
 }
@@ -305,7 +427,7 @@ void
 fuseserver_lookup(fuse_req_t req, fuse_ino_t parent, const char *name)
 {
     struct fuse_entry_param e;
-    // In chfs, timeouts are always set to 0.0, and generations are always set to 0
+    // In chfs, generations are always set to 0
     e.attr_timeout = 0.0;
     e.entry_timeout = 0.0;
     e.generation = 0;
@@ -315,7 +437,9 @@ fuseserver_lookup(fuse_req_t req, fuse_ino_t parent, const char *name)
      chfs->lookup(parent, name, found, ino);
 
     if (found) {
+        // the attributes came back with the lookup, see extent_client
         e.ino = ino;
+        entry_timeouts(&e, parent, name);
         getattr(ino, e.attr);
         fuse_reply_entry(req, &e);
     } else {
@@ -330,36 +454,37 @@ struct dirbuf {
     size_t size;
 };
 
-void dirbuf_add(struct dirbuf *b, const char *name, fuse_ino_t ino)
+void dirbuf_add(fuse_req_t req, struct dirbuf *b, const char *name,
+        fuse_ino_t ino, uint32_t type, off_t next)
 {
     struct stat stbuf;
     size_t oldsize = b->size;
-    b->size += fuse_dirent_size(strlen(name));
+    b->size += fuse_add_direntry(req, NULL, 0, name, NULL, 0);
     b->p = (char *) realloc(b->p, b->size);
     memset(&stbuf, 0, sizeof(stbuf));
     stbuf.st_ino = ino;
-    fuse_add_dirent(b->p + oldsize, name, &stbuf, b->size);
-}
-
-#define min(x, y) ((x) < (y) ? (x) : (y))
-
-int reply_buf_limited(fuse_req_t req, const char *buf, size_t bufsize,
-        off_t off, size_t maxsize)
-{
-    if ((size_t)off < bufsize)
-        return fuse_reply_buf(req, buf + off, min(bufsize - off, maxsize));
+    if (type == extent_protocol::T_DIR)
+        stbuf.st_mode = S_IFDIR;
+    else if (type == extent_protocol::T_SYMLINK)
+        stbuf.st_mode = S_IFLNK;
     else
-        return fuse_reply_buf(req, NULL, 0);
+        stbuf.st_mode = S_IFREG;
+    fuse_add_direntry(req, b->p + oldsize, b->size - oldsize, name, &stbuf, next);
 }
 
+// A directory entry is a 24 byte header and the name, 8 byte aligned;
+// a batch of size / READDIR_GUESS entries about fills a reply.
+#define READDIR_GUESS 32
+
 //
-// Retrieve all the file names / i-numbers pairs
-// in directory @ino. Send the reply using reply_buf_limited.
-//
-// You can ignore @size and @off (except that you must pass
-// them to reply_buf_limited).
+// Reply with the entries of directory @ino that fit in @size bytes,
+// going on after the entry whose cookie is @off, 0 for the first.
+// Each entry carries its cookie to the kernel, so a listing costs a
+// batch of entries per call, not the whole directory. The attributes
+// come along and stay in the extent client's cache for the getattrs
+// of an ls -l.
 //
-// Call dirbuf_add(&b, name, inum) for each entry in the directory.
+// Names of the same hash share a cookie and go out together.
 //
 void
 fuseserver_readdir(fuse_req_t req, fuse_ino_t ino, size_t size,
@@ -367,6 +492,7 @@ fuseserver_readdir(fuse_req_t req, fuse_ino_t ino, size_t size,
 {
     chfs_client::inum inum = ino; // req->in.h.nodeid;
     struct dirbuf b;
+    unsigned long long cookie = off;
 
     printf("fuseserver_readdir\n");
 
@@ -377,13 +503,36 @@ fuseserver_readdir(fuse_req_t req, fuse_ino_t ino, size_t size,
 
     memset(&b, 0, sizeof(b));
 
-    std::list<chfs_client::dirent> entries;
-    chfs->readdir(inum, entries);
-    for (std::list<chfs_client::dirent>::iterator it = entries.begin(); it != entries.end(); ++it) {
-        dirbuf_add(&b, it->name.c_str(), (fuse_ino_t) it->inum);
+    size_t batch = size / READDIR_GUESS + 1;
+    size_t group = 0;   // where the entries of the last cookie start
+    bool full = false;
+    while (!full) {
+        std::list<chfs_client::dirent> entries;
+        if (chfs->readdir(inum, cookie, batch, entries) != chfs_client::OK) {
+            fuse_reply_err(req, EIO);
+            free(b.p);
+            return;
+        }
+        std::list<chfs_client::dirent>::iterator it;
+        for (it = entries.begin(); it != entries.end() && !full; ++it) {
+            if (b.size + fuse_add_direntry(req, NULL, 0, it->name.c_str(), NULL, 0) > size) {
+                // a cookie cannot resume inside a group
+                if (it->cookie == cookie && group > 0)
+                    b.size = group;
+                full = true;
+                break;
+            }
+            if (it->cookie != cookie)
+                group = b.size;
+            dirbuf_add(req, &b, it->name.c_str(), (fuse_ino_t) it->inum,
+                       it->type, it->cookie);
+            cookie = it->cookie;
+        }
+        if (entries.size() < batch)
+            break;
     }
 
-    reply_buf_limited(req, b.p, b.size, off, size);
+    fuse_reply_buf(req, b.p, b.size);
     free(b.p);
 }
 
@@ -395,6 +544,50 @@ fuseserver_open(fuse_req_t req, fuse_ino_t ino,
     fuse_reply_open(req, fi);
 }
 
+//
+// Called on each close of a file, and once more when its last
+// descriptor goes away; both write back the writes chfs_client
+// still caches, and the last one ends read-ahead of the file.
+//
+void
+fuseserver_flush(fuse_req_t req, fuse_ino_t ino,
+        struct fuse_file_info *fi)
+{
+    if (chfs->flush(ino) != chfs_client::OK) {
+        fuse_reply_err(req, EIO);
+        return;
+    }
+    fuse_reply_err(req, 0);
+}
+
+void
+fuseserver_release(fuse_req_t req, fuse_ino_t ino,
+        struct fuse_file_info *fi)
+{
+    if (chfs->release(ino) != chfs_client::OK) {
+        fuse_reply_err(req, EIO);
+        return;
+    }
+    fuse_reply_err(req, 0);
+}
+
+//
+// fsync sends what chfs_client still holds. The extent server answers
+// a call before its journal group commits (see JOURNAL_GROUP), so a
+// crash of a lone server can still lose the last JOURNAL_GROUP_SECS of
+// calls; a replicated one redoes them from its raft log.
+//
+void
+fuseserver_fsync(fuse_req_t req, fuse_ino_t ino, int datasync,
+        struct fuse_file_info *fi)
+{
+    if (chfs->flush(ino) != chfs_client::OK) {
+        fuse_reply_err(req, EIO);
+        return;
+    }
+    fuse_reply_err(req, 0);
+}
+
 //
 // Create a new directory with name @name in parent directory @parent.
 // Leave new directory's inum in e.ino and attributes in e.attr.
@@ -410,10 +603,7 @@ fuseserver_mkdir(fuse_req_t req, fuse_ino_t parent, const char *name,
         mode_t mode)
 {
     struct fuse_entry_param e;
-    // In chfs, timeouts are always set to 0.0, and generations are always set to 0
-    e.attr_timeout = 0.0;
-    e.entry_timeout = 0.0;
-    e.generation = 0;
+    // fuseserver_createhelper sets the timeouts and generation
     // Suppress compiler warning of unused e.
     (void) e;
 
@@ -476,8 +666,7 @@ fuseserver_symlink(fuse_req_t req, const char *link, fuse_ino_t parent, const ch
     }
 
     e.ino = id;
-    e.attr_timeout = 0.0;
-    e.entry_timeout = 0.0;
+    entry_timeouts(&e, parent, name);
     e.generation = 0;
 
     if (getattr(id, e.attr) != chfs_client::OK) {
@@ -501,7 +690,7 @@ fuseserver_readlink(fuse_req_t req, fuse_ino_t ino)
 }
 
 void
-fuseserver_statfs(fuse_req_t req)
+fuseserver_statfs(fuse_req_t req, fuse_ino_t ino)
 {
     struct statvfs buf;
 
@@ -517,33 +706,67 @@ fuseserver_statfs(fuse_req_t req)
 
 struct fuse_lowlevel_ops fuseserver_oper;
 
+/* One worker of the session loop; *err is set like the return of
+ * fuse_session_loop. Requests come in as fuse_bufs, so a write spliced
+ * into a pipe reaches fuseserver_write_buf without a copy on the way. */
+static void
+worker_loop(struct fuse_session *se, struct fuse_chan *ch, int *err)
+{
+    size_t bufsize = fuse_chan_bufsize(ch);
+    std::vector<char> buf(bufsize);
+
+    *err = 0;
+    while (!fuse_session_exited(se)) {
+        struct fuse_chan *tmpch = ch;
+        struct fuse_buf fbuf;
+        memset(&fbuf, 0, sizeof(fbuf));
+        fbuf.mem = &buf[0];
+        fbuf.size = bufsize;
+        int res = fuse_session_receive_buf(se, &fbuf, &tmpch);
+        if (res == -EINTR)
+            continue;
+        if (res <= 0) {
+            *err = res < 0 ? -1 : 0;
+            break;
+        }
+        fuse_session_process_buf(se, &fbuf, tmpch);
+    }
+    // the others may still wait in fuse_chan_recv until the unmount
+    fuse_session_exit(se);
+}
+
 int
 main(int argc, char *argv[])
 {
     char *mountpoint = 0;
     int err = -1;
-    int fd;
 
     setvbuf(stdout, NULL, _IONBF, 0);
 
-#if 1
-    if(argc != 3){
-        fprintf(stderr, "Usage: chfs_client <mountpoint> <port-extent-server>\n");
-        exit(1);
+    int opt;
+    while ((opt = getopt(argc, argv, "t:w:")) != -1) {
+        switch (opt) {
+        case 't':
+            cache_timeout = atof(optarg);
+            break;
+        case 'w':
+            workers = atoi(optarg);
+            break;
+        default:
+            argc = 0;
+        }
     }
-#else
-    if(argc != 2){
-        fprintf(stderr, "Usage: chfs_client <mountpoint>\n");
+    if(argc - optind != 2 || cache_timeout < 0 || workers < 1){
+        fprintf(stderr, "Usage: chfs_client [-t cache-seconds] [-w workers] <mountpoint> <port-extent-server>\n");
         exit(1);
     }
-#endif
-    mountpoint = argv[1];
+    mountpoint = argv[optind];
 
     srandom(getpid());
 
     myid = random();
 
-    chfs = new chfs_client(argv[2]);
+    chfs = new chfs_client(argv[optind + 1]);
     // chfs = new chfs_client();
 
     fuseserver_oper.getattr    = fuseserver_getattr;
@@ -553,8 +776,12 @@ main(int argc, char *argv[])
     fuseserver_oper.create     = fuseserver_create;
     fuseserver_oper.mknod      = fuseserver_mknod;
     fuseserver_oper.open       = fuseserver_open;
+    fuseserver_oper.flush      = fuseserver_flush;
+    fuseserver_oper.release    = fuseserver_release;
+    fuseserver_oper.fsync      = fuseserver_fsync;
     fuseserver_oper.read       = fuseserver_read;
     fuseserver_oper.write      = fuseserver_write;
+    fuseserver_oper.write_buf  = fuseserver_write_buf;
     fuseserver_oper.setattr    = fuseserver_setattr;
     fuseserver_oper.unlink     = fuseserver_unlink;
     fuseserver_oper.mkdir      = fuseserver_mkdir;
@@ -593,8 +820,8 @@ main(int argc, char *argv[])
 
     args.allocated = 0;
 
-    fd = fuse_mount(mountpoint, &args);
-    if(fd == -1){
+    struct fuse_chan *ch = fuse_mount(mountpoint, &args);
+    if(ch == NULL){
         fprintf(stderr, "fuse_mount failed\n");
         exit(1);
     }
@@ -608,19 +835,31 @@ main(int argc, char *argv[])
         exit(1);
     }
 
-    struct fuse_chan *ch = fuse_kern_chan_new(fd);
-    if (ch == NULL) {
-        fprintf(stderr, "fuse_kern_chan_new failed\n");
-        exit(1);
-    }
-
     fuse_session_add_chan(se, ch);
-    // err = fuse_session_loop_mt(se);   // FK: wheelfs does this; why?
-    err = fuse_session_loop(se);
+    if (cache_timeout > 0) {
+        invalidator = new kernel_invalidator(ch);
+        chfs->set_watcher(invalidator);
+    }
+    if (workers == 1) {
+        err = fuse_session_loop(se);
+    } else {
+        // fuse_session_loop_mt would start and stop threads as the load
+        // changes; these stay, each reading and serving one request at
+        // a time like fuse_session_loop does.
+        std::vector<std::thread> pool;
+        std::vector<int> errs(workers, 0);
+        for (int i = 0; i < workers; ++i)
+            pool.push_back(std::thread(worker_loop, se, ch, &errs[i]));
+        for (int i = 0; i < workers; ++i) {
+            pool[i].join();
+            if (errs[i])
+                err = errs[i];
+        }
+    }
 
+    fuse_session_remove_chan(ch);
     fuse_session_destroy(se);
-    close(fd);
-    fuse_unmount(mountpoint);
+    fuse_unmount(mountpoint, ch);
 
     return err ? 1 : 0;
 }
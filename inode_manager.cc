@@ -1,131 +1,1136 @@
 #include "inode_manager.h"
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#define MIN(a,b) ((a)<(b) ? (a) : (b))
+#define MAX(a,b) ((a)>(b) ? (a) : (b))
 
 // disk layer -----------------------------------------
 
-disk::disk()
+/* Whether a disk of this geometry can hold a file system: a supported
+ * block size, room for the metadata and some data, and a size the
+ * 32-bit super block fields can describe. */
+bool
+disk_geometry::valid() const
+{
+  superblock_t sb;
+
+  if (block_size < MIN_BLOCK_SIZE || block_size > MAX_BLOCK_SIZE
+      || (block_size & (block_size - 1)) != 0 || ninodes < 2){
+    return false;
+  }
+  sb.block_size = block_size;
+  sb.nblocks = nblocks;
+  sb.ninodes = ninodes;
+  sb.journal_blocks = JOURNAL_SIZE(sb);
+  return (uint64_t)nblocks * block_size <= UINT32_MAX
+         && (uint64_t)SB_OFFSET + sizeof(sb) <= (uint64_t)nblocks * block_size
+         && FILEBLOCK(sb) < nblocks;
+}
+
+disk::disk(uint32_t bsize, uint32_t n)
+  : block_size(bsize), nblocks(n)
+{
+  fd = -1;
+  blocks = (unsigned char *)calloc(nblocks, block_size);
+}
+
+/* A disk backed by the image file at path, created (zero filled, so
+ * it reads as unformatted) if it does not exist yet. The image is
+ * mapped shared, so every write_block lands in the file. */
+disk::disk(const char *image, uint32_t bsize, uint32_t n)
+  : block_size(bsize), nblocks(n)
+{
+  struct stat st;
+  off_t size = (off_t)nblocks * block_size;
+
+  fd = open(image, O_RDWR | O_CREAT, 0666);
+  if (fd < 0 || fstat(fd, &st) < 0){
+    printf("\tdisk: error! cannot open image %s\n", image);
+    exit(1);
+  }
+  if (st.st_size < size && posix_fallocate(fd, 0, size) != 0){
+    printf("\tdisk: error! cannot preallocate image %s\n", image);
+    exit(1);
+  }
+  blocks = (unsigned char *)mmap(NULL, size,
+      PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  if ((void*)blocks == MAP_FAILED){
+    printf("\tdisk: error! cannot map image %s\n", image);
+    exit(1);
+  }
+}
+
+disk::~disk()
+{
+  if (fd < 0){
+    free(blocks);
+    return;
+  }
+  msync(blocks, (size_t)nblocks * block_size, MS_SYNC);
+  munmap(blocks, (size_t)nblocks * block_size);
+  close(fd);
+}
+
+/* Read len bytes at off of an image file without mapping it; false
+ * if the image does not exist or is too short. Used to find the
+ * geometry of an image before opening it as a disk. */
+bool
+disk::peek(const char *image, uint32_t off, void *buf, uint32_t len)
+{
+  int fd = open(image, O_RDONLY);
+  if (fd < 0){
+    return false;
+  }
+  bool ok = pread(fd, buf, len, off) == (ssize_t)len;
+  close(fd);
+  return ok;
+}
+
+/* Make every write so far durable in the image file. */
+void
+disk::sync()
 {
-  bzero(blocks, sizeof(blocks));
+  if (fd >= 0){
+    msync(blocks, (size_t)nblocks * block_size, MS_SYNC);
+  }
 }
 
 void
 disk::read_block(blockid_t id, char *buf)
 {
-  if (id < 0 || id >= BLOCK_NUM || !buf){
+  if (id >= nblocks || !buf){
     return;
   }
-  memcpy(buf,blocks[id],BLOCK_SIZE);
+  memcpy(buf, blocks + (size_t)id * block_size, block_size);
 }
 
 void
 disk::write_block(blockid_t id, const char *buf)
 {
-  if (id < 0 || id >= BLOCK_NUM || !buf){
+  if (id >= nblocks || !buf){
    return;
   }
-  memcpy(blocks[id],buf,BLOCK_SIZE);
+  memcpy(blocks + (size_t)id * block_size, buf, block_size);
+}
+
+/* Copy the n blocks from start on straight into buf, in one go. */
+void
+disk::read_blocks(blockid_t start, uint32_t n, char *buf)
+{
+  if ((uint64_t)start + n > nblocks || !buf){
+    return;
+  }
+  memcpy(buf, blocks + (size_t)start * block_size, (size_t)n * block_size);
+}
+
+void
+disk::write_blocks(blockid_t start, uint32_t n, const char *buf)
+{
+  if ((uint64_t)start + n > nblocks || !buf){
+    return;
+  }
+  memcpy(blocks + (size_t)start * block_size, buf, (size_t)n * block_size);
+}
+
+// journal -----------------------------------------
+
+journal::journal(disk *dk, blockid_t s, uint32_t n, uint32_t bsize)
+  : d(dk), start(s), nblocks(n), block_size(bsize), seq(0)
+{
+}
+
+/* Blocks taken by the id list of a count block transaction. */
+uint32_t
+journal::id_blocks(uint32_t count) const
+{
+  return (count * sizeof(blockid_t) + block_size - 1) / block_size;
+}
+
+/* The most blocks one transaction can hold. */
+uint32_t
+journal::capacity() const
+{
+  if (nblocks < 3)
+    return 0;
+  return (uint64_t)(nblocks - 1) * block_size / (block_size + sizeof(blockid_t));
+}
+
+/* FNV-1a over the ids and contents of a transaction. */
+uint32_t
+journal::checksum(const blockid_t *ids, uint32_t count, const char *blocks) const
+{
+  uint32_t h = 2166136261u;
+  const unsigned char *p = (const unsigned char *)ids;
+  for (size_t i = 0; i < count * sizeof(blockid_t); ++i)
+    h = (h ^ p[i]) * 16777619u;
+  p = (const unsigned char *)blocks;
+  for (size_t i = 0; i < (size_t)count * block_size; ++i)
+    h = (h ^ p[i]) * 16777619u;
+  return h;
+}
+
+/* Log blocks[i] as the new contents of block ids[i], and make the
+ * transaction durable: once this returns, recovery will redo it. */
+void
+journal::commit(const std::vector<blockid_t> &ids, const std::vector<const char*> &blocks)
+{
+  uint32_t count = ids.size();
+  uint32_t nid = id_blocks(count);
+  char *buf = (char*)calloc((size_t)(nid + count), block_size);
+  journal_header_t *h;
+  char hbuf[MAX_BLOCK_SIZE];
+
+  memcpy(buf, ids.data(), count * sizeof(blockid_t));
+  for (uint32_t i = 0; i < count; ++i)
+    memcpy(buf + (size_t)(nid + i) * block_size, blocks[i], block_size);
+  d->write_blocks(start + 1, nid + count, buf);
+  d->sync();
+
+  bzero(hbuf, block_size);
+  h = (journal_header_t *)hbuf;
+  h->magic = JOURNAL_MAGIC;
+  h->seq = ++seq;
+  h->count = count;
+  h->checksum = checksum((blockid_t *)buf, count, buf + (size_t)nid * block_size);
+  d->write_block(start, hbuf);
+  d->sync();
+  free(buf);
+}
+
+/* Forget the logged transaction, once its blocks are home. */
+void
+journal::clear()
+{
+  char hbuf[MAX_BLOCK_SIZE];
+
+  bzero(hbuf, block_size);
+  d->write_block(start, hbuf);
+}
+
+/* Redo the transaction in the log, if it was committed, writing its
+ * blocks to their home locations. Returns the blocks written. */
+uint32_t
+journal::recover()
+{
+  char hbuf[MAX_BLOCK_SIZE];
+  journal_header_t h;
+  uint32_t count = 0;
+
+  d->read_block(start, hbuf);
+  memcpy(&h, hbuf, sizeof(h));
+  if (h.magic == JOURNAL_MAGIC && h.count > 0 && h.count <= capacity()){
+    uint32_t nid = id_blocks(h.count);
+    char *buf = (char*)malloc((size_t)(nid + h.count) * block_size);
+    blockid_t *ids = (blockid_t *)buf;
+
+    d->read_blocks(start + 1, nid + h.count, buf);
+    if (checksum(ids, h.count, buf + (size_t)nid * block_size) == h.checksum){
+      for (uint32_t i = 0; i < h.count; ++i)
+        d->write_block(ids[i], buf + (size_t)(nid + i) * block_size);
+      d->sync();
+      count = h.count;
+    }
+    seq = h.seq;
+    free(buf);
+  }
+  clear();
+  return count;
+}
+
+// buffer cache -----------------------------------------
+
+buffer_cache::buffer_cache(disk *dk, uint32_t bsize, journal *jnl)
+  : d(dk), log(jnl), block_size(bsize), hits(0), misses(0)
+{
+  data = (char*)malloc((size_t)BCACHE_BLOCKS * block_size);
+  entries.resize(BCACHE_BLOCKS);
+  for (uint32_t e = 0; e < BCACHE_BLOCKS; ++e){
+    entries[e].id = 0;
+    entries[e].valid = false;
+    entries[e].dirty = false;
+    entries[e].prev = e - 1;
+    entries[e].next = e + 1;
+    entries[e].data = data + (size_t)e * block_size;
+  }
+  lru_head = 0;
+  lru_tail = BCACHE_BLOCKS - 1;
+  group_ops = 0;
+  group_start = time(NULL);
+  op_blocks = 0;
+  op_writes = false;
+}
+
+/* From now on commit dirty blocks through log, in which every
+ * operation, of at most op blocks, must fit. */
+void
+buffer_cache::set_journal(journal *jnl, uint32_t op)
+{
+  flush();
+  log = jnl;
+  op_blocks = op;
+}
+
+buffer_cache::~buffer_cache()
+{
+  flush();
+  shrink();
+  delete log;
+  delete d;
+  free(data);
+}
+
+void
+buffer_cache::lru_unlink(uint32_t e)
+{
+  if (e == lru_head)
+    lru_head = entries[e].next;
+  else
+    entries[entries[e].prev].next = entries[e].next;
+  if (e == lru_tail)
+    lru_tail = entries[e].prev;
+  else
+    entries[entries[e].next].prev = entries[e].prev;
+}
+
+void
+buffer_cache::lru_push_front(uint32_t e)
+{
+  entries[e].next = lru_head;
+  entries[lru_head].prev = e;
+  lru_head = e;
+}
+
+/* The entry caching block id, now the most recently used one. On a
+ * miss the least recently used entry is written back if dirty and
+ * reused; the block is read from disk only if load is set (a caller
+ * about to overwrite all of it need not). */
+bcache_entry_t *
+buffer_cache::lookup(blockid_t id, bool load)
+{
+  std::unordered_map<blockid_t, uint32_t>::iterator it = index.find(id);
+  uint32_t e;
+
+  if (it != index.end()){
+    e = it->second;
+    ++hits;
+  }
+  else{
+    e = lru_tail;
+    ++misses;
+    // with a journal a dirty block may not reach the disk before its
+    // commit, so the least recently used clean entry is taken instead
+    while (log && entries[e].dirty){
+      if (e == lru_head){
+        // every entry is dirty; committing now would log part of the
+        // operation under way, so hold one more block until end_op
+        e = grow();
+        break;
+      }
+      e = entries[e].prev;
+    }
+    if (entries[e].valid){
+      write_back(&entries[e]);
+      index.erase(entries[e].id);
+    }
+    entries[e].id = id;
+    entries[e].valid = true;
+    if (load)
+      d->read_block(id, entries[e].data);
+    index[id] = e;
+  }
+  if (e != lru_head){
+    lru_unlink(e);
+    lru_push_front(e);
+  }
+  return &entries[e];
+}
+
+/* Add an unused entry at the least recently used end. */
+uint32_t
+buffer_cache::grow()
+{
+  bcache_entry_t n;
+  uint32_t e = entries.size();
+
+  n.id = 0;
+  n.valid = false;
+  n.dirty = false;
+  n.prev = lru_tail;
+  n.next = e + 1;
+  n.data = (char*)malloc(block_size);
+  entries.push_back(n);
+  entries[lru_tail].next = e;
+  lru_tail = e;
+  return e;
+}
+
+/* Drop the entries grow added, which the last commit left clean. */
+void
+buffer_cache::shrink()
+{
+  while (entries.size() > BCACHE_BLOCKS){
+    uint32_t e = entries.size() - 1;
+    lru_unlink(e);
+    if (entries[e].valid)
+      index.erase(entries[e].id);
+    free(entries[e].data);
+    entries.pop_back();
+  }
+}
+
+void
+buffer_cache::write_back(bcache_entry_t *e)
+{
+  if (e->dirty){
+    d->write_block(e->id, e->data);
+    e->dirty = false;
+  }
+}
+
+void
+buffer_cache::read_block(blockid_t id, char *buf)
+{
+  memcpy(buf, lookup(id, true)->data, block_size);
+}
+
+void
+buffer_cache::write_block(blockid_t id, const char *buf)
+{
+  bcache_entry_t *e = lookup(id, false);
+  memcpy(e->data, buf, block_size);
+  op_writes = true;
+  if (!e->dirty){
+    e->dirty = true;
+    dirty.push_back(e - &entries[0]);
+  }
+}
+
+/* Vectored reads go to the disk directly, run by run, except for
+ * blocks cached here, which may be newer than the disk. */
+void
+buffer_cache::read_blocks(blockid_t start, uint32_t n, char *buf)
+{
+  uint32_t i = 0;
+  while (i < n){
+    std::unordered_map<blockid_t, uint32_t>::iterator it = index.find(start + i);
+    if (it != index.end()){
+      memcpy(buf + (size_t)i * block_size, entries[it->second].data, block_size);
+      ++i;
+      continue;
+    }
+    uint32_t run = 1;
+    while (i + run < n && index.find(start + i + run) == index.end())
+      ++run;
+    d->read_blocks(start + i, run, buf + (size_t)i * block_size);
+    i += run;
+  }
+}
+
+/* Vectored writes go to the disk directly; cached copies of the
+ * blocks are refreshed and, now matching the disk, clean. */
+void
+buffer_cache::write_blocks(blockid_t start, uint32_t n, const char *buf)
+{
+  d->write_blocks(start, n, buf);
+  if (index.empty())
+    return;
+  for (uint32_t i = 0; i < n; ++i){
+    std::unordered_map<blockid_t, uint32_t>::iterator it = index.find(start + i);
+    if (it != index.end()){
+      memcpy(entries[it->second].data, buf + (size_t)i * block_size, block_size);
+      entries[it->second].dirty = false;
+    }
+  }
+}
+
+/* Called at the end of every operation. Without a journal dirty
+ * blocks go to the disk right away; with one, the operation joins the
+ * current group, which is committed once it is JOURNAL_GROUP operations
+ * or JOURNAL_GROUP_SECS old, or the log has no room for another
+ * operation. Return true if the blocks were written back. */
+bool
+buffer_cache::end_op()
+{
+  op_writes = false;
+  if (log == NULL || ++group_ops >= JOURNAL_GROUP
+      || time(NULL) - group_start >= JOURNAL_GROUP_SECS
+      || dirty.size() + op_blocks > log->capacity()
+      || entries.size() > BCACHE_BLOCKS){
+    flush();
+    shrink();
+    return true;
+  }
+  return false;
+}
+
+/* Write every dirty block back to the disk, as one journal transaction
+ * if there is a journal. Only a bug lets a group outgrow the log (see
+ * JOURNAL_OP_BLOCKS); the disk is left as the last commit left it. */
+void
+buffer_cache::flush()
+{
+  std::vector<blockid_t> ids;
+  std::vector<const char*> blocks;
+
+  for (size_t i = 0; i < dirty.size(); ++i){
+    bcache_entry_t *e = &entries[dirty[i]];
+    if (e->dirty){
+      ids.push_back(e->id);
+      blocks.push_back(e->data);
+      e->dirty = false;
+    }
+  }
+  dirty.clear();
+  if (log && !ids.empty()){
+    if (ids.size() > log->capacity()){
+      printf("\tbc: error! transaction of %lu blocks exceeds the journal of %u\n",
+             ids.size(), log->capacity());
+      exit(1);
+    }
+    log->commit(ids, blocks);
+  }
+  for (size_t i = 0; i < ids.size(); ++i)
+    d->write_block(ids[i], blocks[i]);
+  if (log && !ids.empty()){
+    d->sync();
+    log->clear();
+  }
+  group_ops = 0;
+  group_start = time(NULL);
+  op_writes = false;
+}
+
+/* Flush, then make the disk durable. */
+void
+buffer_cache::sync()
+{
+  flush();
+  d->sync();
 }
 
 // block layer -----------------------------------------
 
+bool
+block_manager::test_bit(uint32_t id) const
+{
+  return (bitmap[id/64] >> (id%64)) & 1;
+}
+
+/* Used, or freed since the last commit. */
+bool
+block_manager::in_use(uint32_t id) const
+{
+  return ((bitmap[id/64] | held[id/64]) >> (id%64)) & 1;
+}
+
+void
+block_manager::set_bit(uint32_t id, bool used)
+{
+  if (used)
+    bitmap[id/64] |= 1ULL << (id%64);
+  else
+    bitmap[id/64] &= ~(1ULL << (id%64));
+}
+
+/* Write back the bitmap blocks holding the bits of blocks [from, to). */
+void
+block_manager::flush_bitmap(uint32_t from, uint32_t to)
+{
+  for (uint32_t b = from/BPB(sb); b <= (to-1)/BPB(sb); ++b){
+    cache->write_block(BBLOCK(b*BPB(sb), sb), (const char*)(bitmap + b*(BPB(sb)/64)));
+  }
+}
+
 // Allocate a free disk block.
 blockid_t
 block_manager::alloc_block()
 {
-  /*
-   * your code goes here.
-   * note: you should mark the corresponding bit in block bitmap when alloc.
-   * you need to think about which block you can start to be allocated.
-   */
-  uint32_t block_num;
-  for (block_num = FILEBLOCK;block_num<sb.nblocks;++block_num){
-    if (using_blocks[block_num]==false){
-      using_blocks[block_num]=true;
-      return block_num;
+  blockid_t id;
+  if (alloc_blocks(1, &id) == 0){
+    return 0;
+  }
+  return id;
+}
+
+/* Allocate a run of at most n contiguous free blocks.
+ * The search skips full bitmap words and resumes where the last
+ * allocation stopped (next-fit), so it is O(1) amortized.
+ * Return the length of the run starting at *start, 0 if the disk is full. */
+uint32_t
+block_manager::alloc_blocks(uint32_t n, blockid_t *start)
+{
+  if (n == 0){
+    return 0;
+  }
+  for (uint32_t scanned = 0; scanned < bitmap_words; ++scanned){
+    uint32_t w = (cursor + scanned) % bitmap_words;
+    uint64_t used = bitmap[w] | held[w];
+    if (used == ~0ULL){
+      continue;
     }
+    blockid_t first = w*64 + __builtin_ctzll(~used);
+    uint32_t len = 0;
+    while (len < n && first + len < sb.nblocks){
+      blockid_t id = first + len;
+      if (id%64 == 0 && n - len >= 64 && (bitmap[id/64] | held[id/64]) == 0){
+        // a whole free word
+        bitmap[id/64] = ~0ULL;
+        len += 64;
+        continue;
+      }
+      if (in_use(id)){
+        break;
+      }
+      set_bit(id, true);
+      ++len;
+    }
+    flush_bitmap(first, first + len);
+    cursor = (first + len)/64 % bitmap_words;
+    nfree -= len;
+    *start = first;
+    return len;
   }
   //如果没有空余的block则直接返回
   return 0;
 }
 
+/* Called before an operation allocates n blocks. If fewer are free
+ * because freed blocks wait for their commit, commit the group now,
+ * which cannot split the operation as long as it has not written a
+ * block yet; otherwise the allocation may fail for want of space. */
+void
+block_manager::make_room(uint32_t n)
+{
+  if (nfree < n && nheld > 0 && !cache->in_op()){
+    flush();
+  }
+}
+
 void
 block_manager::free_block(uint32_t id)
 {
-  /* 
-   * your code goes here.
-   * note: you should unmark the corresponding bit in the block bitmap when free.
-   */
-  using_blocks[id]=false;
+  if (id < FILEBLOCK(sb) || id >= sb.nblocks){
+    printf("\tbm: error! free invalid block %u\n", id);
+    return;
+  }
+  if (!test_bit(id)){
+    printf("\tbm: error! free of free block %u\n", id);
+    return;
+  }
+  set_bit(id, false);
+  flush_bitmap(id, id + 1);
+  if (cache->journaled()){
+    held[id/64] |= 1ULL << (id%64);
+    ++nheld;
+  }
+  else{
+    ++nfree;
+  }
   return;
 }
 
-void inode_manager::alloc_nth_block(inode_t* ino,uint32_t n)
+/* The commit that freed the held blocks is on the disk. */
+void
+block_manager::release_held()
 {
-  char buf[BLOCK_SIZE];
-  if (ino == NULL){
-    exit(0);
+  if (nheld > 0){
+    bzero(held, bitmap_words * sizeof(uint64_t));
+    nfree += nheld;
+    nheld = 0;
   }
-  if (n < NDIRECT){
-    ino->blocks[n] = bm->alloc_block();
+}
+
+/* Number of data blocks mapped by one entry of an indirect block
+ * at the given depth (0 = entries point at data blocks). */
+uint32_t
+inode_manager::indirect_span(uint32_t depth)
+{
+  uint32_t span = 1;
+  while (depth-- > 0)
+    span *= NINDIRECT(bm->sb);
+  return span;
+}
+
+/* For file block n >= NDIRECT, return which indirect block of the
+ * inode maps it (1 single, 2 double, 3 triple) and its index *idx
+ * among the blocks mapped by that tree. */
+uint32_t
+inode_manager::indirect_level(uint32_t n, uint32_t *idx)
+{
+  uint32_t base = NDIRECT;
+  for (uint32_t level = 1; level <= NLEVELS; ++level){
+    uint32_t cap = indirect_span(level);
+    if (n - base < cap){
+      *idx = n - base;
+      return level;
+    }
+    base += cap;
   }
-  else if (n < MAXFILE){
-    if (ino->blocks[NDIRECT]==0){
-      ino->blocks[NDIRECT] = bm->alloc_block();
+  return 0;
+}
+
+/* Allocate a zero filled indirect block. */
+blockid_t
+inode_manager::alloc_indirect_block()
+{
+  char buf[MAX_BLOCK_SIZE];
+  blockid_t id = bm->alloc_block();
+  if (id != 0){
+    bzero(buf, bm->sb.block_size);
+    bm->write_block(id, buf);
+  }
+  return id;
+}
+
+/* Allocate the data blocks [from, to) of ino, which has blocks up to
+ * from, in as few contiguous runs as possible; indirect blocks are
+ * allocated on the way. If the disk fills up, every block allocated
+ * here is freed again, bc is emptied and false is returned. */
+bool inode_manager::alloc_block_range(inode_t* ino, uint32_t from, uint32_t to, bmap_cache_t *bc)
+{
+  if (ino == NULL || to > MAXFILE(bm->sb)){
+    printf("\tim: error! alloc block range [%u, %u) out of range\n", from, to);
+    return false;
+  }
+
+  // the data blocks, and at most this many indirect blocks
+  bm->make_room(to - from + (to - from)/NINDIRECT(bm->sb) + 2*NLEVELS);
+  uint32_t n = from;
+  while (n < to){
+    blockid_t start;
+    uint32_t got = bm->alloc_blocks(to - n, &start);
+    if (got == 0){
+      break;
+    }
+    uint32_t k;
+    for (k = 0; k < got; ++k, ++n){
+      if (!set_nth_blockId(ino, n, start + k, bc)){
+        break;
+      }
+    }
+    if (k < got){
+      for (; k < got; ++k){
+        bm->free_block(start + k);
+      }
+      break;
     }
-    bm->read_block(ino->blocks[NDIRECT],buf);
-    ((blockid_t*)buf)[n-NDIRECT] = bm->alloc_block();
-    bm->write_block(ino->blocks[NDIRECT], buf);
   }
-  else
-    exit(0);
+  if (n == to){
+    return true;
+  }
+  printf("\tim: error! no free blocks for [%u, %u)\n", from, to);
+
+  // indirect blocks allocated for block n, which did not get mapped,
+  // begin at n, so freeing up to n + 1 releases them too
+  flush_bmap(bc);
+  free_block_range(ino, from, n < NDIRECT ? n : n + 1);
+  bzero(bc, sizeof(*bc));
+  return false;
 }
 
-blockid_t inode_manager::get_nth_blockId(inode_t *ino, uint32_t n){
-  char buf[BLOCK_SIZE];
+/* Free the entries [from, to) of the indirect block id at the given
+ * depth, where from/to count data blocks relative to the start of
+ * the tree. Emptied child indirect blocks are freed and unlinked. */
+void inode_manager::free_indirect_tree(blockid_t id, uint32_t depth, uint32_t from, uint32_t to)
+{
+  char buf[MAX_BLOCK_SIZE];
+  blockid_t *entries = (blockid_t*)buf;
+  uint32_t span = indirect_span(depth);
+  bool dirty = false;
+
+  bm->read_block(id, buf);
+  for (uint32_t i = from/span; i <= (to-1)/span; ++i){
+    if (entries[i] == 0){
+      continue;
+    }
+    if (depth == 0){
+      bm->free_block(entries[i]);
+      continue;
+    }
+    uint32_t child_from = MAX(from, i*span) - i*span;
+    uint32_t child_to = MIN(to, (i+1)*span) - i*span;
+    free_indirect_tree(entries[i], depth-1, child_from, child_to);
+    if (child_from == 0){
+      bm->free_block(entries[i]);
+      entries[i] = 0;
+      dirty = true;
+    }
+  }
+  if (dirty){
+    bm->write_block(id, buf);
+  }
+}
+
+/* Free the data blocks [from, to) of ino, where to is the current
+ * end of the file, and every indirect block left without entries. */
+void inode_manager::free_block_range(inode_t* ino, uint32_t from, uint32_t to)
+{
+  if (ino == NULL || from >= to){
+    return;
+  }
+  for (uint32_t n = from; n < to && n < NDIRECT; ++n){
+    bm->free_block(ino->blocks[n]);
+    ino->blocks[n] = 0;
+  }
+
+  uint32_t base = NDIRECT;
+  for (uint32_t level = 1; level <= NLEVELS && base < to; ++level){
+    uint32_t cap = indirect_span(level);
+    blockid_t *root = &ino->blocks[NDIRECT + level - 1];
+    if (*root != 0 && from < base + cap){
+      uint32_t tree_from = MAX(from, base) - base;
+      uint32_t tree_to = MIN(to - base, cap);
+      free_indirect_tree(*root, level-1, tree_from, tree_to);
+      if (tree_from == 0){
+        bm->free_block(*root);
+        *root = 0;
+      }
+    }
+    base += cap;
+  }
+}
+
+/* Return the entries of indirect block id, which sits at the given
+ * depth, reading it into bc unless bc already holds it. */
+blockid_t *
+inode_manager::bmap_entries(bmap_cache_t *bc, uint32_t depth, blockid_t id)
+{
+  if (bc->id[depth] != id){
+    if (bc->dirty[depth]){
+      bm->write_block(bc->id[depth], bc->buf[depth]);
+      bc->dirty[depth] = false;
+    }
+    bm->read_block(id, bc->buf[depth]);
+    bc->id[depth] = id;
+  }
+  return (blockid_t*)bc->buf[depth];
+}
+
+/* Write back the indirect blocks modified through bc. */
+void
+inode_manager::flush_bmap(bmap_cache_t *bc)
+{
+  for (uint32_t depth = 0; depth < NLEVELS; ++depth){
+    if (bc->dirty[depth]){
+      bm->write_block(bc->id[depth], bc->buf[depth]);
+      bc->dirty[depth] = false;
+    }
+  }
+}
+
+/* Walk the indirect blocks down to the address of file block n.
+ * Indirect blocks already in bc are not read again. */
+blockid_t inode_manager::get_nth_blockId(inode_t *ino, uint32_t n, bmap_cache_t *bc){
+  uint32_t idx, level;
   blockid_t blockId;
 
   if (n < NDIRECT){
-    blockId = ino->blocks[n];
+    return ino->blocks[n];
   }
-  else if (n < MAXFILE){
-    bm->read_block(ino->blocks[NDIRECT],buf);
-    blockId = ((blockid_t*)buf)[n-NDIRECT];
+  level = indirect_level(n, &idx);
+  if (level == 0){
+    printf("\tim: error! file block %u out of range\n", n);
+    return 0;
   }
-  else{
-    exit(0);
+  blockId = ino->blocks[NDIRECT + level - 1];
+  for (uint32_t depth = level; depth-- > 0 && blockId != 0; ){
+    blockId = bmap_entries(bc, depth, blockId)[idx / indirect_span(depth) % NINDIRECT(bm->sb)];
   }
   return blockId;
 }
 
+/* Map file block n to id, allocating missing indirect blocks.
+ * Modified indirect blocks stay in bc until flush_bmap().
+ * Return false if n is out of range or an indirect block could not be
+ * allocated; those allocated on the way stay linked. */
+bool inode_manager::set_nth_blockId(inode_t *ino, uint32_t n, blockid_t id, bmap_cache_t *bc){
+  blockid_t *entries;
+  uint32_t idx, level;
+  blockid_t cur;
+
+  if (n < NDIRECT){
+    ino->blocks[n] = id;
+    return true;
+  }
+  level = indirect_level(n, &idx);
+  if (level == 0){
+    printf("\tim: error! file block %u out of range\n", n);
+    return false;
+  }
+  if (ino->blocks[NDIRECT + level - 1] == 0){
+    ino->blocks[NDIRECT + level - 1] = alloc_indirect_block();
+  }
+  cur = ino->blocks[NDIRECT + level - 1];
+  if (cur == 0){
+    return false;
+  }
+  for (uint32_t depth = level; depth-- > 0; ){
+    uint32_t e = idx / indirect_span(depth) % NINDIRECT(bm->sb);
+    entries = bmap_entries(bc, depth, cur);
+    if (depth == 0){
+      entries[e] = id;
+      bc->dirty[depth] = true;
+      break;
+    }
+    if (entries[e] == 0){
+      entries[e] = alloc_indirect_block();
+      if (entries[e] == 0){
+        return false;
+      }
+      bc->dirty[depth] = true;
+    }
+    cur = entries[e];
+  }
+  return true;
+}
+
+/* Read the whole file blocks [from, to) of ino into buf, which holds
+ * (to - from) blocks. Addresses are looked up BMAP_BATCH at a time
+ * and each batch goes to the block layer as one vectored read, so
+ * blocks the allocator laid out contiguously cost a single copy. */
+void
+inode_manager::read_file_blocks(inode_t *ino, uint32_t from, uint32_t to,
+                                char *buf, bmap_cache_t *bc)
+{
+  blockid_t ids[BMAP_BATCH];
+
+  while (from < to){
+    uint32_t n = MIN(to - from, BMAP_BATCH);
+    for (uint32_t i = 0; i < n; ++i)
+      ids[i] = get_nth_blockId(ino, from + i, bc);
+    bm->read_blocks(ids, n, buf);
+    buf += (size_t)n * bm->sb.block_size;
+    from += n;
+  }
+}
+
+void
+inode_manager::write_file_blocks(inode_t *ino, uint32_t from, uint32_t to,
+                                 const char *buf, bmap_cache_t *bc)
+{
+  blockid_t ids[BMAP_BATCH];
+
+  while (from < to){
+    uint32_t n = MIN(to - from, BMAP_BATCH);
+    for (uint32_t i = 0; i < n; ++i)
+      ids[i] = get_nth_blockId(ino, from + i, bc);
+    bm->write_blocks(ids, n, buf);
+    buf += (size_t)n * bm->sb.block_size;
+    from += n;
+  }
+}
+
 // The layout of disk should be like this:
-// |<-sb->|<-free block bitmap->|<-inode table->|<-data->|
-block_manager::block_manager()
+// |<-sb->|<-free block bitmap->|<-inode bitmap->|<-inode table->|<-data->|
+block_manager::block_manager(const char *image, const disk_geometry &geo)
 {
-  d = new disk();
+  disk_geometry g = geo;
 
-  // format the disk
-  sb.size = BLOCK_SIZE * BLOCK_NUM;
-  sb.nblocks = BLOCK_NUM;
-  sb.ninodes = INODE_NUM;
+  // mount the image if it holds a file system, in its own geometry
+  bzero(&sb, sizeof(sb));
+  formatted = true;
+  if (image && disk::peek(image, SB_OFFSET, &sb, sizeof(sb))
+      && sb.magic == FS_MAGIC){
+    disk_geometry own;
+    own.block_size = sb.block_size;
+    own.nblocks = sb.nblocks;
+    own.ninodes = sb.ninodes;
+    if (own.valid() && FILEBLOCK(sb) < sb.nblocks){
+      g = own;
+      formatted = false;
+    }
+  }
+  if (!g.valid()){
+    printf("\tbm: error! bad geometry: %u blocks of %u bytes, %u inodes\n",
+           g.nblocks, g.block_size, g.ninodes);
+    exit(1);
+  }
+  if (!formatted && (g.block_size != geo.block_size || g.nblocks != geo.nblocks
+                     || g.ninodes != geo.ninodes)){
+    printf("\tbm: mounting %s with its own geometry: %u blocks of %u bytes, %u inodes\n",
+           image, g.nblocks, g.block_size, g.ninodes);
+  }
 
+  disk *d = image ? new disk(image, g.block_size, g.nblocks)
+                  : new disk(g.block_size, g.nblocks);
+  journal *log = NULL;
+  if (!formatted && sb.journal_blocks > 0){
+    // redo the last committed transaction before reading anything
+    char buf[MAX_BLOCK_SIZE];
+    log = new journal(d, JBLOCK(sb), sb.journal_blocks, sb.block_size);
+    uint32_t n = log->recover();
+    if (n > 0){
+      printf("\tbm: redid a transaction of %u blocks from the journal\n", n);
+    }
+    d->read_block(SB_OFFSET/sb.block_size, buf);
+    memcpy(&sb, buf + SB_OFFSET%sb.block_size, sizeof(sb));
+  }
+  cache = new buffer_cache(d, g.block_size);
+  if (formatted){
+    sb.block_size = g.block_size;
+    sb.nblocks = g.nblocks;
+    sb.ninodes = g.ninodes;
+    sb.journal_blocks = JOURNAL_SIZE(sb);
+    format();
+    log = new journal(d, JBLOCK(sb), sb.journal_blocks, sb.block_size);
+  }
+  else{
+    bitmap_words = (sb.nblocks + BPB(sb) - 1)/BPB(sb) * (BPB(sb)/64);
+    bitmap = (uint64_t*)calloc(bitmap_words, sizeof(uint64_t));
+    for (uint32_t b = 0; b < bitmap_words/(BPB(sb)/64); ++b){
+      cache->read_block(BBLOCK(b*BPB(sb), sb), (char*)(bitmap + b*(BPB(sb)/64)));
+    }
+  }
+  cursor = FILEBLOCK(sb)/64;
+  held = (uint64_t*)calloc(bitmap_words, sizeof(uint64_t));
+  nheld = 0;
+  nfree = 0;
+  for (uint32_t w = 0; w < bitmap_words; ++w){
+    nfree += 64 - __builtin_popcountll(bitmap[w]);
+  }
+
+  // an in-memory disk dies with the process, journaling it buys nothing
+  if (image && log && log->capacity() > 0){
+    if (log->capacity() < JOURNAL_OP_BLOCKS(sb)){
+      printf("\tbm: warning! the journal of %s holds %u blocks, an operation may dirty %u\n",
+             image, log->capacity(), JOURNAL_OP_BLOCKS(sb));
+    }
+    cache->set_journal(log, JOURNAL_OP_BLOCKS(sb));
+  }
+  else{
+    delete log;
+  }
+}
+
+block_manager::~block_manager()
+{
+  delete cache;
+  free(bitmap);
+  free(held);
+}
+
+/* Lay out an empty file system: super block, a bitmap with only the
+ * metadata blocks in use, and a zeroed inode bitmap and inode table. */
+void
+block_manager::format()
+{
+  char buf[MAX_BLOCK_SIZE];
+
+  sb.size = sb.block_size * sb.nblocks;
+  sb.magic = FS_MAGIC;
+  sb.log_index = 0;
+
+  // super block, bitmap, inode table and journal blocks are never handed out
+  bitmap_words = (sb.nblocks + BPB(sb) - 1)/BPB(sb) * (BPB(sb)/64);
+  bitmap = (uint64_t*)calloc(bitmap_words, sizeof(uint64_t));
+  for (uint32_t id = 0; id < FILEBLOCK(sb); ++id){
+    set_bit(id, true);
+  }
+  for (uint32_t id = sb.nblocks; id < bitmap_words*64; ++id){
+    set_bit(id, true);
+  }
+  flush_bitmap(0, sb.nblocks);
+
+  bzero(buf, sb.block_size);
+  for (uint32_t id = IBMBLOCK(0, sb); id < FILEBLOCK(sb); ++id){
+    cache->write_block(id, buf);
+  }
+  write_sb();
+  cache->flush();
+}
+
+/* Write the in-memory super block back to SB_OFFSET. */
+void
+block_manager::write_sb()
+{
+  char buf[MAX_BLOCK_SIZE];
+
+  cache->read_block(SB_OFFSET/sb.block_size, buf);
+  memcpy(buf + SB_OFFSET%sb.block_size, &sb, sizeof(sb));
+  cache->write_block(SB_OFFSET/sb.block_size, buf);
+}
+
+/* The end of an operation, see buffer_cache::end_op. */
+void
+block_manager::end_op()
+{
+  if (cache->end_op()){
+    release_held();
+  }
+}
+
+/* Write the dirty cached blocks back to the disk. */
+void
+block_manager::flush()
+{
+  cache->flush();
+  release_held();
+}
+
+void
+block_manager::sync()
+{
+  cache->sync();
+  release_held();
 }
 
 void
 block_manager::read_block(uint32_t id, char *buf)
 {
-  d->read_block(id, buf);
+  cache->read_block(id, buf);
 }
 
 void
 block_manager::write_block(uint32_t id, const char *buf)
 {
-  d->write_block(id, buf);
+  cache->write_block(id, buf);
+}
+
+/* Read blocks ids[0..n) into consecutive block sized slots of buf.
+ * Runs of consecutive ids are transferred by a single disk access. */
+void
+block_manager::read_blocks(const blockid_t *ids, uint32_t n, char *buf)
+{
+  uint32_t i = 0;
+  while (i < n){
+    uint32_t run = 1;
+    while (i + run < n && ids[i + run] == ids[i] + run)
+      ++run;
+    cache->read_blocks(ids[i], run, buf + (size_t)i * sb.block_size);
+    i += run;
+  }
+}
+
+void
+block_manager::write_blocks(const blockid_t *ids, uint32_t n, const char *buf)
+{
+  uint32_t i = 0;
+  while (i < n){
+    uint32_t run = 1;
+    while (i + run < n && ids[i + run] == ids[i] + run)
+      ++run;
+    cache->write_blocks(ids[i], run, buf + (size_t)i * sb.block_size);
+    i += run;
+  }
 }
 
 // inode layer -----------------------------------------
 
-inode_manager::inode_manager()
+inode_manager::inode_manager(const char *image, const disk_geometry &geo)
 {
-  bm = new block_manager();
+  bm = new block_manager(image, geo);
+  bzero(icache, sizeof(icache));
+  icache_hand = 0;
+  op_depth = 0;
+  load_inode_bitmap();
+  flush();
+  if (!bm->formatted) {
+    // a mounted image already has its root dir
+    return;
+  }
   uint32_t root_dir = alloc_inode(extent_protocol::T_DIR);
   if (root_dir != 1) {
     printf("\tim: error! alloc first inode %d, should be 1\n", root_dir);
@@ -133,36 +1138,121 @@ inode_manager::inode_manager()
   }
 }
 
+inode_manager::~inode_manager()
+{
+  flush();
+  delete bm;
+  free(inode_bitmap);
+}
+
+/* Group the mutations up to the matching end_op into one operation,
+ * so they reach the journal in the same transaction. */
+void
+inode_manager::begin_op()
+{
+  op_depth++;
+}
+
+void
+inode_manager::end_op()
+{
+  if (--op_depth == 0){
+    flush();
+  }
+}
+
+/* The index of the last replicated log entry applied to this disk,
+ * kept in the super block so a restart can skip what the image
+ * already reflects. */
+uint32_t
+inode_manager::get_log_index()
+{
+  return bm->sb.log_index;
+}
+
+void
+inode_manager::set_log_index(uint32_t index)
+{
+  bm->sb.log_index = index;
+  bm->write_sb();
+  flush();
+}
+
+/* Rebuild the inode bitmap from the inode table, once at startup,
+ * and write it back so the on-disk copy matches. */
+void
+inode_manager::load_inode_bitmap()
+{
+  char buf[MAX_BLOCK_SIZE];
+
+  inode_bitmap_words = IBMAP_BLOCKS(bm->sb) * (BPB(bm->sb)/64);
+  inode_bitmap = (uint64_t*)calloc(inode_bitmap_words, sizeof(uint64_t));
+  inode_cursor = 0;
+
+  // inum 0 is never handed out, nor is anything past ninodes
+  inode_bitmap[0] |= 1;
+  for (uint32_t inum = bm->sb.ninodes; inum < inode_bitmap_words*64; ++inum){
+    inode_bitmap[inum/64] |= 1ULL << (inum%64);
+  }
+  for (uint32_t inum = 1; inum < bm->sb.ninodes; ++inum){
+    if (inum == 1 || inum%IPB(bm->sb) == 0){
+      bm->read_block(IBLOCK(inum, bm->sb), buf);
+    }
+    if (((struct inode*)buf + inum%IPB(bm->sb))->type != 0){
+      inode_bitmap[inum/64] |= 1ULL << (inum%64);
+    }
+  }
+  for (uint32_t b = 0; b < IBMAP_BLOCKS(bm->sb); ++b){
+    bm->write_block(IBMBLOCK(b*BPB(bm->sb), bm->sb), (const char*)(inode_bitmap + b*(BPB(bm->sb)/64)));
+  }
+}
+
+/* Write back the inode bitmap block holding the bit of inum. */
+void
+inode_manager::flush_inode_bitmap(uint32_t inum)
+{
+  uint32_t b = inum/BPB(bm->sb);
+  bm->write_block(IBMBLOCK(inum, bm->sb), (const char*)(inode_bitmap + b*(BPB(bm->sb)/64)));
+}
+
 /* Create a new file.
  * Return its inum. */
 uint32_t
 inode_manager::alloc_inode(uint32_t type)
 {
-  /* 
-   * your code goes here.
-   * note: the normal inode block should begin from the 2nd inode block.
-   * the 1st is used for root_dir, see inode_manager::inode_manager().
+  /*
+   * find the lowest clear bit in the inode bitmap, starting from the
+   * first word that may have one, so no inode block is read.
+   * the lowest free inum depends on the bitmap alone, so a replica that
+   * restarted from its image hands out the same inums as the others.
+   * the 1st inode is used for root_dir, see inode_manager::inode_manager().
    */
-  int inum = 1;
-  for (; inum<=INODE_NUM; ++inum){
-    inode_t *ino = get_inode(inum);
-    if (ino==NULL){
-      ino = (inode_t*)malloc(sizeof(inode_t));
-      bzero(ino,sizeof(inode_t));
-      ino->type = type;
-      ino->atime = time(NULL);
-      ino->mtime = time(NULL);
-      ino->ctime = time(NULL);
-      put_inode(inum,ino);
-      free(ino);
+  uint32_t inum = 0;
+  for (uint32_t scanned = 0; scanned < inode_bitmap_words; ++scanned){
+    uint32_t w = (inode_cursor + scanned) % inode_bitmap_words;
+    if (inode_bitmap[w] != ~0ULL){
+      inum = w*64 + __builtin_ctzll(~inode_bitmap[w]);
+      inode_cursor = w;
       break;
     }
-    free(ino);
   }
-  if (inum>INODE_NUM){
+  if (inum == 0){
     printf("Error: no inode numbers avaliable!\n");
     exit(-1);
   }
+
+  inode_t *ino = (inode_t*)malloc(sizeof(inode_t));
+  bzero(ino,sizeof(inode_t));
+  ino->type = type;
+  ino->atime = time(NULL);
+  ino->mtime = time(NULL);
+  ino->ctime = time(NULL);
+  put_inode(inum,ino);
+  free(ino);
+
+  inode_bitmap[inum/64] |= 1ULL << (inum%64);
+  flush_inode_bitmap(inum);
+  flush();
   return inum;
 }
 
@@ -177,66 +1267,172 @@ inode_manager::free_inode(uint32_t inum)
   inode_t *ino = get_inode(inum);
   if (ino!=NULL){
     if (ino->type==0){
+      release_inode(ino);
       return;
     }
     else{
       bzero(ino,sizeof(inode_t));
       put_inode(inum,ino);
-      free(ino);
+      release_inode(ino);
+      inode_bitmap[inum/64] &= ~(1ULL << (inum%64));
+      inode_cursor = MIN(inode_cursor, inum/64);
+      flush_inode_bitmap(inum);
+      flush();
     }
   }
   return;
 }
 
 
-/* Return an inode structure by inum, NULL otherwise.
- * Caller should release the memory. */
+/* The cache entry of inum, pinned. On a miss the CLOCK hand evicts
+ * the first unpinned entry whose referenced bit is clear (writing it
+ * back if dirty), and the inode is read from the table if load is set.
+ * NULL if every entry is pinned. */
+icache_entry_t *
+inode_manager::icache_slot(uint32_t inum, bool load)
+{
+  icache_entry_t *e;
+  std::unordered_map<uint32_t, uint32_t>::iterator it = icache_index.find(inum);
+
+  if (it != icache_index.end()){
+    e = &icache[it->second];
+    e->referenced = true;
+    e->pins++;
+    return e;
+  }
+
+  e = NULL;
+  for (uint32_t scanned = 0; scanned < 2*ICACHE_SIZE; ++scanned){
+    icache_entry_t *c = &icache[icache_hand];
+    icache_hand = (icache_hand + 1) % ICACHE_SIZE;
+    if (c->pins > 0){
+      continue;
+    }
+    if (c->referenced){
+      c->referenced = false;
+      continue;
+    }
+    e = c;
+    break;
+  }
+  if (e == NULL){
+    printf("\tim: error! inode cache full, %u inodes pinned\n", ICACHE_SIZE);
+    return NULL;
+  }
+  if (e->inum != 0){
+    write_back_inode(e);
+    icache_index.erase(e->inum);
+  }
+
+  if (load){
+    char buf[MAX_BLOCK_SIZE];
+    bm->read_block(IBLOCK(inum, bm->sb), buf);
+    e->ino = *((struct inode*)buf + inum%IPB(bm->sb));
+  }
+  else{
+    bzero(&e->ino, sizeof(inode_t));
+  }
+  e->inum = inum;
+  e->pins = 1;
+  e->dirty = false;
+  e->referenced = true;
+  icache_index[inum] = e - icache;
+  return e;
+}
+
+/* Copy ino into the inode table block of inum. */
+void
+inode_manager::write_inode_block(uint32_t inum, const inode_t *ino)
+{
+  char buf[MAX_BLOCK_SIZE];
+
+  bm->read_block(IBLOCK(inum, bm->sb), buf);
+  *((struct inode*)buf + inum%IPB(bm->sb)) = *ino;
+  bm->write_block(IBLOCK(inum, bm->sb), buf);
+}
+
+/* Copy a dirty cached inode into its inode table block. */
+void
+inode_manager::write_back_inode(icache_entry_t *e)
+{
+  if (!e->dirty)
+    return;
+  write_inode_block(e->inum, &e->ino);
+  e->dirty = false;
+}
+
+/* Write every dirty cached inode back and end the operation in the
+ * block layer, which writes or journals the dirty blocks; called at
+ * the end of each operation that changes the file system, and put
+ * off to end_op inside begin_op. */
+void
+inode_manager::flush()
+{
+  if (op_depth > 0){
+    return;
+  }
+  for (uint32_t i = 0; i < ICACHE_SIZE; ++i){
+    write_back_inode(&icache[i]);
+  }
+  bm->end_op();
+}
+
+/* Return the cached inode inum, pinned, NULL if it is not in use.
+ * Caller should release it with release_inode. */
 struct inode* 
 inode_manager::get_inode(uint32_t inum)
 {
-  struct inode *ino;
-  /* 
-   * your code goes here.
-   */
-  char buf[BLOCK_SIZE];
-  struct inode *inode_disk;
+  icache_entry_t *e;
 
-
-  if (inum < 0 || inum >= INODE_NUM){
+  if (inum < 0 || inum >= bm->sb.ninodes){
     printf("\tim: inum out of range\n");
     return NULL;
   } 
 
-  bm->read_block(IBLOCK(inum, bm->sb.nblocks), buf);
-
-  inode_disk = (struct inode*)buf + inum%IPB;  //IPB=1,inum%IPB=0
-
-  if (inode_disk->type == 0){
+  e = icache_slot(inum, true);
+  if (e == NULL){
+    return NULL;
+  }
+  if (e->ino.type == 0){
     //The inode does not exist, has not been allocated, and returns null
+    e->pins--;
     return NULL;
   }
-
-  ino = (struct inode*)malloc(sizeof(struct inode));
-  *ino = *inode_disk;
-  return ino;
+  return &e->ino;
 }
 
+/* Store ino as inode inum. Only the cache is updated; the inode
+ * table follows on flush or eviction. ino may be the pointer
+ * get_inode returned. With every cache entry pinned, inum is not
+ * cached either, and ino goes straight to the inode table. */
 void
 inode_manager::put_inode(uint32_t inum, struct inode *ino)
 {
-  char buf[BLOCK_SIZE];
-  struct inode *ino_disk;
+  icache_entry_t *e;
 
   if (ino == NULL)
     return;
 
-  bm->read_block(IBLOCK(inum, bm->sb.nblocks), buf);
-  ino_disk = (struct inode*)buf + inum%IPB;
-  *ino_disk = *ino;
-  bm->write_block(IBLOCK(inum, bm->sb.nblocks), buf);
+  e = icache_slot(inum, false);
+  if (e == NULL){
+    write_inode_block(inum, ino);
+    return;
+  }
+  e->ino = *ino;
+  e->dirty = true;
+  e->pins--;
 }
 
-#define MIN(a,b) ((a)<(b) ? (a) : (b))
+/* Unpin an inode returned by get_inode. */
+void
+inode_manager::release_inode(struct inode *ino)
+{
+  icache_entry_t *e = (icache_entry_t*)ino;
+
+  if (e != NULL && e->pins > 0){
+    e->pins--;
+  }
+}
 
 /* Get all the data of a file by inum. 
  * Return alloced data, should be freed by caller. */
@@ -250,31 +1446,80 @@ inode_manager::read_file(uint32_t inum, char **buf_out, int *size)
    */
   uint32_t block_num;
   uint32_t remain_size;
-  char buf[BLOCK_SIZE];
+  char buf[MAX_BLOCK_SIZE];
+  bmap_cache_t bc = {};
 
   inode_t* ino = get_inode(inum);
   if (ino!=NULL){
     *size = ino->size;
     *buf_out = (char*)malloc(*size);
 
-    block_num = ino->size/BLOCK_SIZE;
-    remain_size = ino->size%BLOCK_SIZE;
+    block_num = ino->size/bm->sb.block_size;
+    remain_size = ino->size%bm->sb.block_size;
 
-    for (uint32_t i=0; i<block_num; ++i){
-      bm->read_block(get_nth_blockId(ino,i), buf);
-      memcpy(*buf_out + i*BLOCK_SIZE, buf, BLOCK_SIZE);
-    }
+    read_file_blocks(ino, 0, block_num, *buf_out, &bc);
     if (remain_size>0){
-      bm->read_block(get_nth_blockId(ino,block_num),buf);
-      memcpy(*buf_out + block_num*BLOCK_SIZE, buf, remain_size);
+      bm->read_block(get_nth_blockId(ino,block_num,&bc),buf);
+      memcpy(*buf_out + block_num*bm->sb.block_size, buf, remain_size);
     }
-    free(ino);
+    release_inode(ino);
   }
   return;
 }
 
-/* alloc/free blocks if needed */
+/* Get at most len bytes of file inum starting at byte off.
+ * Only the blocks covering [off, off+len) are read.
+ * Return alloced data, should be freed by caller. */
 void
+inode_manager::read_file_range(uint32_t inum, uint32_t off, uint32_t len,
+                               char **buf_out, int *size)
+{
+  uint32_t end, first_block, last_block, full_from, full_to, copied;
+  char buf[MAX_BLOCK_SIZE];
+  bmap_cache_t bc = {};
+
+  *size = 0;
+  *buf_out = NULL;
+  inode_t* ino = get_inode(inum);
+  if (ino == NULL){
+    return;
+  }
+  if (off >= ino->size || len == 0){
+    release_inode(ino);
+    return;
+  }
+
+  end = MIN((uint64_t)off + len, (uint64_t)ino->size);
+  *size = end - off;
+  *buf_out = (char*)malloc(*size);
+
+  first_block = off/bm->sb.block_size;
+  last_block = (end-1)/bm->sb.block_size;
+  // blocks wholly inside [off, end) go straight into the output
+  full_from = ((uint64_t)off + bm->sb.block_size - 1)/bm->sb.block_size;
+  full_to = end/bm->sb.block_size;
+  if (full_from < full_to){
+    read_file_blocks(ino, full_from, full_to,
+                     *buf_out + full_from*bm->sb.block_size - off, &bc);
+  }
+  copied = 0;
+  for (uint32_t i=first_block; i<=last_block; ++i){
+    uint32_t block_start = i*bm->sb.block_size;
+    uint32_t from = MAX(off, block_start) - block_start;
+    uint32_t to = MIN(end, block_start + bm->sb.block_size) - block_start;
+    if (i < full_from || i >= full_to){
+      bm->read_block(get_nth_blockId(ino,i,&bc), buf);
+      memcpy(*buf_out + copied, buf + from, to - from);
+    }
+    copied += to - from;
+  }
+  release_inode(ino);
+  return;
+}
+
+/* alloc/free blocks if needed.
+ * Return IOERR, leaving the file as it was, if it would not fit. */
+extent_protocol::status
 inode_manager::write_file(uint32_t inum, const char *buf, int size)
 {
   /*
@@ -285,46 +1530,143 @@ inode_manager::write_file(uint32_t inum, const char *buf, int size)
    */
   uint32_t old_block_num,new_block_num,remain_size;
   uint32_t block_num;
+  bmap_cache_t bc = {};
   //判断size是否超过了一个文件的最大大小
-  if (size < 0||size > MAXFILE*BLOCK_SIZE){
-     exit(0);
+  if (size < 0||(uint64_t)size > (uint64_t)MAXFILE(bm->sb)*bm->sb.block_size){
+    printf("\tim: error! write_file size %d too large\n", size);
+    return extent_protocol::IOERR;
   }
   inode* ino = get_inode(inum);
-  if (ino!=NULL){
+  if (ino == NULL){
+    return extent_protocol::NOENT;
+  }
+  else{
     //比较写入后和写入前的大小，释放掉多余的block，申请不够的block
-    old_block_num = ino->size == 0 ? 0 : (ino->size-1)/BLOCK_SIZE + 1;
-    new_block_num = size == 0 ? 0 : (size-1)/BLOCK_SIZE +1;
+    old_block_num = ino->size == 0 ? 0 : (ino->size-1)/bm->sb.block_size + 1;
+    new_block_num = size == 0 ? 0 : (size-1)/bm->sb.block_size +1;
 
     if (old_block_num < new_block_num){
-      for (uint32_t i=old_block_num;i<new_block_num;++i){
-        alloc_nth_block(ino,i);
+      if (!alloc_block_range(ino, old_block_num, new_block_num, &bc)){
+        release_inode(ino);
+        return extent_protocol::IOERR;
       }
     }
     else if (old_block_num > new_block_num){
-      for (uint32_t i=old_block_num; i<new_block_num; ++i){
-        bm->free_block(get_nth_blockId(ino,i));
-      }
+      free_block_range(ino, new_block_num, old_block_num);
     }
-    block_num = size/BLOCK_SIZE;
-    remain_size = size%BLOCK_SIZE;
+    block_num = size/bm->sb.block_size;
+    remain_size = size%bm->sb.block_size;
 
-    for (uint32_t i=0; i<block_num; ++i){
-      bm->write_block(get_nth_blockId(ino,i), buf + i*BLOCK_SIZE);
-    }
+    write_file_blocks(ino, 0, block_num, buf, &bc);
     if (remain_size>0){
-      char tmp[BLOCK_SIZE];
-      memcpy(tmp, buf+block_num*BLOCK_SIZE, remain_size);
-      bm->write_block(get_nth_blockId(ino,block_num),tmp);
+      char tmp[MAX_BLOCK_SIZE];
+      memcpy(tmp, buf+block_num*bm->sb.block_size, remain_size);
+      bm->write_block(get_nth_blockId(ino,block_num,&bc),tmp);
     }
+    flush_bmap(&bc);
     
     ino->size = size;
     ino->atime = time(NULL);
     ino->mtime = time(NULL);
     ino->ctime = time(NULL);
     put_inode(inum, ino);
-    free(ino);
+    release_inode(ino);
+    flush();
   }
-  return;
+  return extent_protocol::OK;
+}
+
+/* Write len bytes of buf at byte off of file inum, like pwrite.
+ * Only the blocks covering the range (plus the hole between the old
+ * end of file and off, which is zero filled) are touched.
+ * Return IOERR if the range ends past the largest file. */
+extent_protocol::status
+inode_manager::write_file_range(uint32_t inum, uint32_t off, const char *buf, uint32_t len)
+{
+  uint32_t old_size, new_size, end, start;
+  uint32_t old_block_num, new_block_num, full_from, full_to, hole_to;
+  char tmp[MAX_BLOCK_SIZE];
+  bmap_cache_t bc = {};
+
+  if ((uint64_t)off + len > (uint64_t)MAXFILE(bm->sb)*bm->sb.block_size
+      || (uint64_t)off + len > UINT32_MAX){
+    printf("\tim: write_file_range out of range, off %u len %u\n", off, len);
+    return extent_protocol::IOERR;
+  }
+  inode_t* ino = get_inode(inum);
+  if (ino == NULL){
+    return extent_protocol::NOENT;
+  }
+  if (len == 0){
+    // like pwrite, writing nothing does not extend the file
+    release_inode(ino);
+    return extent_protocol::OK;
+  }
+
+  old_size = ino->size;
+  end = off + len;
+  new_size = MAX(old_size, end);
+  old_block_num = old_size == 0 ? 0 : (old_size-1)/bm->sb.block_size + 1;
+  new_block_num = new_size == 0 ? 0 : (new_size-1)/bm->sb.block_size + 1;
+  if (old_block_num < new_block_num
+      && !alloc_block_range(ino, old_block_num, new_block_num, &bc)){
+    release_inode(ino);
+    return extent_protocol::IOERR;
+  }
+
+  // bytes in [start, end) change: the hole after the old eof and the data
+  start = MIN(off, old_size);
+  // blocks wholly inside [off, end) are written straight from buf,
+  // only the partial ones at either end go through tmp
+  full_from = ((uint64_t)off + bm->sb.block_size - 1)/bm->sb.block_size;
+  full_to = end/bm->sb.block_size;
+  if (full_from < full_to){
+    write_file_blocks(ino, full_from, full_to,
+                      buf + full_from*bm->sb.block_size - off, &bc);
+  }
+  // so are the whole blocks of the hole, zeros, keeping them out of
+  // the journal however large the hole is
+  hole_to = off/bm->sb.block_size;
+  if (old_block_num < hole_to){
+    uint32_t batch = MIN(hole_to - old_block_num, BMAP_BATCH);
+    char *zeros = (char*)calloc(batch, bm->sb.block_size);
+    for (uint32_t i=old_block_num; i<hole_to; i+=batch){
+      write_file_blocks(ino, i, MIN(i + batch, hole_to), zeros, &bc);
+    }
+    free(zeros);
+  }
+  if (start < end){
+    for (uint32_t i=start/bm->sb.block_size; i<=(end-1)/bm->sb.block_size; ++i){
+      uint32_t block_start = i*bm->sb.block_size;
+      uint32_t block_end = block_start + bm->sb.block_size;
+      if ((i >= full_from && i < full_to) || (i >= old_block_num && i < hole_to)){
+        continue;
+      }
+      blockid_t bid = get_nth_blockId(ino,i,&bc);
+
+      if (i < old_block_num && (block_start < start || block_end > end)){
+        bm->read_block(bid, tmp);
+      }
+      for (uint32_t b=MAX(old_size, block_start); b<block_end; ++b){
+        tmp[b - block_start] = 0;
+      }
+      if (off < block_end && end > block_start){
+        uint32_t from = MAX(off, block_start);
+        uint32_t to = MIN(end, block_end);
+        memcpy(tmp + from - block_start, buf + from - off, to - from);
+      }
+      bm->write_block(bid, tmp);
+    }
+  }
+  flush_bmap(&bc);
+
+  ino->size = new_size;
+  ino->mtime = time(NULL);
+  ino->ctime = time(NULL);
+  put_inode(inum, ino);
+  release_inode(ino);
+  flush();
+  return extent_protocol::OK;
 }
 
 void
@@ -346,7 +1688,7 @@ inode_manager::get_attr(uint32_t inum, extent_protocol::attr &a)
   a.mtime = ino->mtime;
   a.ctime = ino->ctime;
 
-  free(ino);
+  release_inode(ino);
   return;
 }
 
@@ -359,15 +1701,10 @@ inode_manager::remove_file(uint32_t inum)
    */
   inode_t *ino = get_inode(inum);
   if (ino!=NULL){
-    uint32_t block_num = ino->size == 0 ? 0 : (ino->size-1)/BLOCK_SIZE + 1;
-    for (uint32_t i =0; i < block_num; ++i){
-      bm->free_block(get_nth_blockId(ino,i));
-    }
-    if (block_num > NDIRECT){
-      bm -> free_block(ino->blocks[NDIRECT]);
-    }
+    uint32_t block_num = ino->size == 0 ? 0 : (ino->size-1)/bm->sb.block_size + 1;
+    free_block_range(ino, 0, block_num);
     free_inode(inum);
-    free(ino);
+    release_inode(ino);
   }
   return;
 }
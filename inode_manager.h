@@ -4,95 +4,369 @@
 #define inode_h
 
 #include <stdint.h>
+#include <time.h>
+#include <unordered_map>
+#include <vector>
 #include "extent_protocol.h"
 
-#define DISK_SIZE  1024*1024*16
+// Default geometry; a disk can be given another one when it is
+// created (see disk_geometry), and an existing image keeps its own.
+#define DISK_SIZE  (1024*1024*16)
 #define BLOCK_SIZE 512
 #define BLOCK_NUM  (DISK_SIZE/BLOCK_SIZE)
+#define INODE_NUM  1024
+
+// Supported block sizes are the powers of two in between; buffers that
+// hold one block are sized for the largest.
+#define MIN_BLOCK_SIZE 512
+#define MAX_BLOCK_SIZE 4096
 
 typedef uint32_t blockid_t;
 
+struct disk_geometry {
+  uint32_t block_size;
+  uint32_t nblocks;
+  uint32_t ninodes;
+
+  disk_geometry(uint32_t bsize = BLOCK_SIZE, uint32_t disk_size = DISK_SIZE,
+                uint32_t inodes = INODE_NUM)
+    : block_size(bsize), nblocks(disk_size / bsize), ninodes(inodes) {}
+  bool valid() const;
+};
+
 // disk layer -----------------------------------------
 
 class disk {
  private:
-  unsigned char blocks[BLOCK_NUM][BLOCK_SIZE];
+  unsigned char *blocks;
+  uint32_t block_size;
+  uint32_t nblocks;
+  int fd;   // backing image file, -1 for an in-memory disk
 
  public:
-  disk();
+  disk(uint32_t block_size, uint32_t nblocks);
+  disk(const char *image, uint32_t block_size, uint32_t nblocks);
+  ~disk();
+  static bool peek(const char *image, uint32_t off, void *buf, uint32_t len);
   void read_block(uint32_t id, char *buf);
   void write_block(uint32_t id, const char *buf);
+  void read_blocks(uint32_t start, uint32_t n, char *buf);
+  void write_blocks(uint32_t start, uint32_t n, const char *buf);
+  void sync();
+};
+
+// journal -----------------------------------------
+
+// A redo log in a region of the disk. Each commit writes a transaction,
+// the block ids and new contents of a group of dirty blocks, to the log
+// and then its header; only after that do the blocks go to their home
+// locations. A header whose checksum matches marks a transaction that
+// recovery (at mount) writes home again, so a crash leaves either all
+// of a transaction on the disk or none of it.
+#define JOURNAL_MAGIC  0x6a726e6c   // "jrnl"
+#define JOURNAL_BLOCKS 1024         // log size of a new file system...
+#define JOURNAL_SIZE(sb) \
+  (JOURNAL_PART(sb) > JOURNAL_MIN(sb) ? JOURNAL_PART(sb) : JOURNAL_MIN(sb))
+#define JOURNAL_PART(sb) \
+  ((sb).nblocks/16 < JOURNAL_BLOCKS ? (sb).nblocks/16 : JOURNAL_BLOCKS)  // ...at most 1/16 of it,
+#define JOURNAL_MIN(sb) \
+  (JOURNAL_OP_BLOCKS(sb) + JOURNAL_OP_BLOCKS(sb)/NINDIRECT(sb) + 2)     // ...but never too small
+
+// A transaction never splits an operation, so the log must hold the
+// most blocks one operation dirties (JOURNAL_MIN adds their ids and the
+// header): every block bitmap block, an indirect block per NINDIRECT
+// data blocks, and JOURNAL_CALL_BLOCKS (inodes, partial data blocks,
+// the indirect blocks a file has partly filled, the super block) for
+// each of up to EXTENT_COMPOUND_MAX calls. Whole data blocks do not go
+// through the log.
+#define JOURNAL_CALL_BLOCKS 32
+#define JOURNAL_OP_BLOCKS(sb) \
+  ((sb).nblocks/BPB(sb) + 1 + (sb).nblocks/NINDIRECT(sb) \
+   + EXTENT_COMPOUND_MAX*JOURNAL_CALL_BLOCKS)
+
+typedef struct journal_header {
+  uint32_t magic;      // JOURNAL_MAGIC while a transaction awaits checkpoint
+  uint32_t seq;
+  uint32_t count;      // blocks in the transaction
+  uint32_t checksum;   // of the block ids and contents
+} journal_header_t;
+
+class journal {
+ private:
+  disk *d;
+  blockid_t start;     // header block; the ids, then the contents follow
+  uint32_t nblocks;
+  uint32_t block_size;
+  uint32_t seq;
+  uint32_t id_blocks(uint32_t count) const;
+  uint32_t checksum(const blockid_t *ids, uint32_t count, const char *blocks) const;
+
+ public:
+  journal(disk *d, blockid_t start, uint32_t nblocks, uint32_t block_size);
+  uint32_t capacity() const;
+  void commit(const std::vector<blockid_t> &ids, const std::vector<const char*> &blocks);
+  void clear();
+  uint32_t recover();
+};
+
+// buffer cache -----------------------------------------
+
+// Blocks the buffer cache holds. Single block reads and writes (bitmap,
+// super block, inode table, indirect and partial data blocks) go through
+// it; vectored transfers of whole data blocks bypass it, so streaming a
+// large file does not push the metadata out.
+#define BCACHE_BLOCKS 1024
+
+// With a journal, the dirty blocks of up to JOURNAL_GROUP operations
+// (or JOURNAL_GROUP_SECS seconds of them) are committed as one
+// transaction, and dirty blocks stay cached until their commit. A
+// transaction only ever ends at end_op: an operation that finds every
+// block dirty grows the cache past BCACHE_BLOCKS instead, and the
+// group is committed at its end, or earlier if the next operation
+// might not fit the log. An operation is done, and answered, before
+// its group commits, so a crash can lose the last JOURNAL_GROUP_SECS
+// of them (the replicated server redoes those from its raft log).
+#define JOURNAL_GROUP      16
+#define JOURNAL_GROUP_SECS 1
+
+typedef struct bcache_entry {
+  blockid_t id;
+  bool valid;
+  bool dirty;
+  uint32_t prev;   // LRU list neighbours, towards the most and
+  uint32_t next;   // the least recently used entry
+  char *data;
+} bcache_entry_t;
+
+class buffer_cache {
+ private:
+  disk *d;
+  journal *log;        // NULL: dirty blocks are written in place
+  uint32_t block_size;
+  std::vector<bcache_entry_t> entries;   // BCACHE_BLOCKS, more until end_op
+  char *data;
+  std::unordered_map<blockid_t, uint32_t> index;   // block id -> entry
+  std::vector<uint32_t> dirty;                     // entries to write back
+  uint32_t lru_head;   // most recently used
+  uint32_t lru_tail;   // least recently used, evicted first
+  uint32_t group_ops;  // operations since the last commit
+  time_t group_start;
+  uint32_t op_blocks;  // the most blocks one operation dirties
+  bool op_writes;      // the current operation has dirtied blocks
+  void lru_unlink(uint32_t e);
+  void lru_push_front(uint32_t e);
+  bcache_entry_t *lookup(blockid_t id, bool load);
+  void write_back(bcache_entry_t *e);
+  uint32_t grow();
+  void shrink();
+
+ public:
+  buffer_cache(disk *d, uint32_t block_size, journal *log = NULL);
+  ~buffer_cache();
+  uint64_t hits;
+  uint64_t misses;
+  void read_block(blockid_t id, char *buf);
+  void write_block(blockid_t id, const char *buf);
+  void read_blocks(blockid_t start, uint32_t n, char *buf);
+  void write_blocks(blockid_t start, uint32_t n, const char *buf);
+  void set_journal(journal *log, uint32_t op_blocks);
+  bool journaled() const { return log != NULL; }
+  bool in_op() const { return op_writes; }
+  bool end_op();
+  void flush();
+  void sync();
 };
 
 // block layer -----------------------------------------
 
+#define FS_MAGIC 0x63686673   // "chfs"
+
+// The super block sits at a fixed byte offset whatever the block size,
+// so an image can be mounted before its geometry is known: block 1 of
+// a 512 byte block disk, inside the unused block 0 of larger ones.
+#define SB_OFFSET 512
+
 typedef struct superblock {
   uint32_t size;
   uint32_t nblocks;
   uint32_t ninodes;
+  uint32_t magic;       // FS_MAGIC once the disk has been formatted
+  uint32_t log_index;   // last raft log entry applied to this disk
+  uint32_t block_size;
+  uint32_t journal_blocks;   // 0 for images made before the journal
 } superblock_t;
 
 class block_manager {
  private:
-  disk *d;
-  std::map <uint32_t, int> using_blocks;
+  buffer_cache *cache;   // over the disk
+  // In-memory copy of the on-disk block bitmap (bit set = block in use),
+  // laid out exactly as the BBLOCK() bitmap blocks.
+  uint64_t *bitmap;
+  uint32_t bitmap_words;
+  uint32_t cursor;     // next-fit: word to resume the free-bit search from
+  // Whole data blocks are written in place at once, outside the journal,
+  // so a block freed since the last commit is not handed out again
+  // until that commit: the disk may still give it to its old file.
+  uint64_t *held;      // freed, not yet committed, laid out as bitmap
+  uint32_t nheld;
+  uint32_t nfree;      // free blocks, not counting the held ones
+  bool test_bit(uint32_t id) const;
+  bool in_use(uint32_t id) const;
+  void set_bit(uint32_t id, bool used);
+  void release_held();
+  void flush_bitmap(uint32_t from, uint32_t to);
+  void format();
  public:
-  block_manager();
+  block_manager(const char *image = NULL,
+                const disk_geometry &geo = disk_geometry());
+  ~block_manager();
   struct superblock sb;
+  bool formatted;   // true if the disk was empty and has just been formatted
 
   uint32_t alloc_block();
+  uint32_t alloc_blocks(uint32_t n, blockid_t *start);
   void free_block(uint32_t id);
+  void make_room(uint32_t n);
   void read_block(uint32_t id, char *buf);
   void write_block(uint32_t id, const char *buf);
+  void read_blocks(const blockid_t *ids, uint32_t n, char *buf);
+  void write_blocks(const blockid_t *ids, uint32_t n, const char *buf);
+  void write_sb();
+  void end_op();
+  void flush();
+  void sync();
+  uint64_t cache_hits() const { return cache->hits; }
+  uint64_t cache_misses() const { return cache->misses; }
 };
 
 // inode layer -----------------------------------------
 
-#define INODE_NUM  1024
+// The macros below take the super block of the disk, whose geometry
+// is only known at run time.
 
 // Inodes per block.
-#define IPB           1
-//(BLOCK_SIZE / sizeof(struct inode))
-
-// Block containing inode i
-#define IBLOCK(i, nblocks)     ((nblocks)/BPB + (i)/IPB + 3)
+#define IPB(sb)           ((sb).block_size / sizeof(struct inode))
 
 // Bitmap bits per block
-#define BPB           (BLOCK_SIZE*8)
+#define BPB(sb)           ((sb).block_size*8)
+
+// Inode bitmap blocks, between the block bitmap and the inode table
+#define IBMAP_BLOCKS(sb)  (((sb).ninodes + BPB(sb) - 1)/BPB(sb))
+
+// Block containing bit for inode i
+#define IBMBLOCK(i, sb)   ((sb).nblocks/BPB(sb) + (i)/BPB(sb) + 3)
+
+// Block containing inode i
+#define IBLOCK(i, sb)     ((sb).nblocks/BPB(sb) + IBMAP_BLOCKS(sb) + (i)/IPB(sb) + 3)
 
 // Block containing bit for block b
-#define BBLOCK(b) ((b)/BPB + 2)
+#define BBLOCK(b, sb) ((b)/BPB(sb) + 2)
+
+// On-disk inodes are 128 bytes, so IPB inodes share one block
+#define INODE_SIZE 128
+// blocks[NDIRECT], blocks[NDIRECT+1] and blocks[NDIRECT+2] are the
+// single, double and triple indirect blocks
+#define NLEVELS 3
+#define NDIRECT ((INODE_SIZE - 20) / sizeof(blockid_t) - NLEVELS)
+#define NINDIRECT(sb) ((sb).block_size / sizeof(blockid_t))
+#define MAXFILE(sb) (NDIRECT + NINDIRECT(sb) + NINDIRECT(sb)*NINDIRECT(sb) \
+                     + NINDIRECT(sb)*NINDIRECT(sb)*NINDIRECT(sb))
 
-#define NDIRECT 100
-#define NINDIRECT (BLOCK_SIZE / sizeof(uint))
-#define MAXFILE (NDIRECT + NINDIRECT)
+// First journal block, after the inode table
+#define JBLOCK(sb)    (IBLOCK((sb).ninodes, sb) + 1)
 
-#define FILEBLOCK IBLOCK(INODE_NUM,sb.nblocks) + 1
+// First data block
+#define FILEBLOCK(sb) (JBLOCK(sb) + (sb).journal_blocks)
 typedef struct inode {
   short type;
   unsigned int size;
   unsigned int atime;
   unsigned int mtime;
   unsigned int ctime;
-  blockid_t blocks[NDIRECT+1];   // Data block addresses
+  blockid_t blocks[NDIRECT+NLEVELS];   // Data block addresses
 } inode_t;
 
+static_assert(sizeof(inode_t) == INODE_SIZE, "on-disk inode must stay compact");
+static_assert(MIN_BLOCK_SIZE % INODE_SIZE == 0, "inodes must not straddle blocks");
+
+// File blocks whose addresses read_file_blocks/write_file_blocks
+// look up before each vectored block transfer
+#define BMAP_BATCH 256
+
+// The indirect blocks one read_file/write_file call has walked through,
+// one per depth (0 = blocks whose entries are data block addresses).
+// Consecutive file blocks share them, so each is read (and written
+// back, if modified) once per call instead of once per data block.
+typedef struct bmap_cache {
+  blockid_t id[NLEVELS];
+  bool dirty[NLEVELS];
+  char buf[NLEVELS][MAX_BLOCK_SIZE];
+} bmap_cache_t;
+
+// In-memory inode cache, ICACHE_SIZE inodes with CLOCK replacement.
+// get_inode pins an entry until release_inode; put_inode only marks it
+// dirty, and dirty inodes reach the inode table when evicted or at the
+// end of the operation that changed them (flush).
+#define ICACHE_SIZE 128
+
+typedef struct icache_entry {
+  inode_t ino;        // first, so a cached inode_t* is its entry
+  uint32_t inum;      // 0 = slot unused
+  uint32_t pins;
+  bool dirty;
+  bool referenced;    // CLOCK bit, set on every hit
+} icache_entry_t;
+
 class inode_manager {
  private:
   block_manager *bm;
+  // In-memory copy of the inode bitmap (bit set = inum in use),
+  // laid out exactly as the IBMBLOCK() bitmap blocks.
+  uint64_t *inode_bitmap;
+  uint32_t inode_bitmap_words;
+  uint32_t inode_cursor; // every inode bitmap word before it is full
+  void load_inode_bitmap();
+  void flush_inode_bitmap(uint32_t inum);
+  icache_entry_t icache[ICACHE_SIZE];
+  std::unordered_map<uint32_t, uint32_t> icache_index;  // inum -> slot
+  uint32_t icache_hand;
+  uint32_t op_depth;     // nesting of begin_op
+  icache_entry_t *icache_slot(uint32_t inum, bool load);
+  void write_inode_block(uint32_t inum, const inode_t *ino);
+  void write_back_inode(icache_entry_t *e);
+  void flush();
   struct inode* get_inode(uint32_t inum);
   void put_inode(uint32_t inum, struct inode *ino);
-  void alloc_nth_block(inode_t* ino,uint32_t n);
-  blockid_t get_nth_blockId(inode_t* ino,uint32_t n);
+  void release_inode(struct inode *ino);
+  bool alloc_block_range(inode_t* ino, uint32_t from, uint32_t to, bmap_cache_t *bc);
+  void free_block_range(inode_t* ino, uint32_t from, uint32_t to);
+  blockid_t get_nth_blockId(inode_t* ino, uint32_t n, bmap_cache_t *bc);
+  bool set_nth_blockId(inode_t* ino, uint32_t n, blockid_t id, bmap_cache_t *bc);
+  blockid_t *bmap_entries(bmap_cache_t *bc, uint32_t depth, blockid_t id);
+  void flush_bmap(bmap_cache_t *bc);
+  uint32_t indirect_span(uint32_t depth);
+  uint32_t indirect_level(uint32_t n, uint32_t *idx);
+  blockid_t alloc_indirect_block();
+  void free_indirect_tree(blockid_t id, uint32_t depth, uint32_t from, uint32_t to);
+  void read_file_blocks(inode_t *ino, uint32_t from, uint32_t to, char *buf, bmap_cache_t *bc);
+  void write_file_blocks(inode_t *ino, uint32_t from, uint32_t to, const char *buf, bmap_cache_t *bc);
 
  public:
-  inode_manager();
+  inode_manager(const char *image = NULL,
+                const disk_geometry &geo = disk_geometry());
+  ~inode_manager();
   uint32_t alloc_inode(uint32_t type);
   void free_inode(uint32_t inum);
   void read_file(uint32_t inum, char **buf, int *size);
-  void write_file(uint32_t inum, const char *buf, int size);
+  void read_file_range(uint32_t inum, uint32_t off, uint32_t len, char **buf, int *size);
+  extent_protocol::status write_file(uint32_t inum, const char *buf, int size);
+  extent_protocol::status write_file_range(uint32_t inum, uint32_t off, const char *buf, uint32_t len);
   void remove_file(uint32_t inum);
   void get_attr(uint32_t inum, extent_protocol::attr &a);
+  void begin_op();
+  void end_op();
+  uint32_t get_log_index();
+  void set_log_index(uint32_t index);
 };
 
 #endif
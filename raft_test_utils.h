@@ -2,6 +2,7 @@
 #define test_utils_h
 
 #include <dirent.h>
+#include <errno.h>
 #include <fcntl.h>
 #include <set>
 #include <sstream>
@@ -131,12 +132,21 @@ public:
   int num_append_logs;
 };
 
+// Create the state machine of a node whose raft log is kept in storage_dir.
+// State machines that keep their own on-disk state specialize this.
+template <typename state_machine>
+state_machine *create_state_machine(const std::string &storage_dir) {
+  return new state_machine();
+}
+
 template <typename state_machine, typename command> class raft_group {
 public:
   // typedef raft<list_state_machine, list_command> raft<state_machine,
   // command>;
 
-  raft_group(int num, const char *storage_dir = "raft_temp");
+  // storage_dir is wiped first unless keep is set, in which case the
+  // nodes resume from the raft logs (and state) left there
+  raft_group(int num, const char *storage_dir = "raft_temp", bool keep = false);
   ~raft_group();
 
   int check_exact_one_leader();
@@ -170,25 +180,26 @@ public:
 
 template <typename state_machine, typename command>
 raft_group<state_machine, command>::raft_group(int num,
-                                               const char *storage_dir) {
+                                               const char *storage_dir, bool keep) {
     // printf("raft_group created begin\n");
     nodes.resize(num, nullptr);
     servers = create_random_rpc_servers(num);
     clients.resize(num);
     states.resize(num);
     storages.resize(num);
-    remove_directory(storage_dir);
+    if (!keep)
+        remove_directory(storage_dir);
     // ASSERT(ret == 0 || , "cannot rmdir " << ret);
-    ASSERT(mkdir(storage_dir, 0777) >= 0,
+    ASSERT(mkdir(storage_dir, 0777) >= 0 || (keep && errno == EEXIST),
            "cannot create dir " << std::string(storage_dir));
     // printf("raft_group created-0\n");
            for (int i = 0; i < num; i++) {
                std::string dir_name(storage_dir);
                dir_name = dir_name + "/raft_storage_" + std::to_string(i);
-               ASSERT(mkdir(dir_name.c_str(), 0777) >= 0,
+               ASSERT(mkdir(dir_name.c_str(), 0777) >= 0 || (keep && errno == EEXIST),
                       "cannot create dir " << std::string(storage_dir));
                raft_storage<command> *storage = new raft_storage<command>(dir_name);
-               state_machine *state = new state_machine();
+               state_machine *state = create_state_machine<state_machine>(dir_name);
                auto client = create_rpc_clients(servers);
                raft<state_machine, command> *node =
                    new raft<state_machine, command>(servers[i], client, i, storage, state);
@@ -449,9 +460,10 @@ int raft_group<state_machine, command>::restart(int node) {
   servers[node]->unreg_all();
   delete nodes[node];
   delete states[node];
-  states[node] = new state_machine();
-  raft_storage<command> *storage = new raft_storage<command>(
-      std::string("raft_temp/raft_storage_") + std::to_string(node));
+  std::string dir_name =
+      std::string("raft_temp/raft_storage_") + std::to_string(node);
+  states[node] = create_state_machine<state_machine>(dir_name);
+  raft_storage<command> *storage = new raft_storage<command>(dir_name);
   // recreate clients
   for (auto &cl : clients[node])
     delete cl;
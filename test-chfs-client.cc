@@ -0,0 +1,123 @@
+// Regression tests of the extent client cache, against an extent
+// server in the same process.
+
+#include "extent_server.h"
+#include "extent_client.h"
+
+#include <unistd.h>
+#include <stdio.h>
+
+#include <string>
+#include <vector>
+
+#define iprint(msg) \
+    printf("[TEST_ERROR]: %s\n", msg);
+
+std::string start_extent_server(extent_server *es) {
+    int port = 20000 + getpid() % 10000;
+    rpcs *server = new rpcs(port);
+    server->reg(extent_protocol::get, es, &extent_server::get);
+    server->reg(extent_protocol::getattr, es, &extent_server::getattr);
+    server->reg(extent_protocol::put, es, &extent_server::put);
+    server->reg(extent_protocol::remove, es, &extent_server::remove);
+    server->reg(extent_protocol::create, es, &extent_server::create);
+    server->reg(extent_protocol::read, es, &extent_server::read);
+    server->reg(extent_protocol::write, es, &extent_server::write);
+    server->reg(extent_protocol::lookup, es, &extent_server::lookup);
+    server->reg(extent_protocol::add_entry, es, &extent_server::add_entry);
+    server->reg(extent_protocol::remove_entry, es, &extent_server::remove_entry);
+    server->reg(extent_protocol::create_entry, es, &extent_server::create_entry);
+    server->reg(extent_protocol::compound, es, &extent_server::compound);
+    server->reg(extent_protocol::readdir, es, &extent_server::readdir);
+    return std::to_string(port);
+}
+
+// Fill the disk with a new file, written straight on the server.
+extent_protocol::extentid_t fill_disk(extent_server &es) {
+    extent_protocol::extentid_t big;
+    unsigned int off = 0;
+    int unused;
+    es.create(extent_protocol::T_FILE, big);
+    for (size_t step = 1 << 20; step >= 512; step /= 2) {
+        while (es.write(big, off, std::string(step, 'b'), unused) == extent_protocol::OK)
+            off += step;
+    }
+    return big;
+}
+
+// Writes to a cached extent are acknowledged at once; when the server
+// cannot take them they stay cached and dirty, every way of writing
+// them back reports the failure, and they reach the server once it can.
+int test_failed_write_back(extent_server &es, const std::string &port) {
+    extent_client ec(port), other(port, 0);
+    extent_protocol::extentid_t f, g;
+    std::string data(1000, 'd'), got;
+    extent_protocol::attr a;
+
+    printf("========== begin test failed write back ==========\n");
+    ec.create_entry(1, extent_protocol::T_FILE, "f", "", f);
+    ec.create_entry(1, extent_protocol::T_FILE, "g", "", g);
+    ec.get(f, got);
+    ec.get(g, got);
+    extent_protocol::extentid_t big = fill_disk(es);
+
+    if (ec.write(f, 0, data) != extent_protocol::OK
+        || ec.write(g, 0, data) != extent_protocol::OK) {
+        iprint("a cached write failed");
+        return 1;
+    }
+    if (ec.flush(f) == extent_protocol::OK) {
+        iprint("flush of one extent hid a failed write back");
+        return 2;
+    }
+    if (ec.flush() == extent_protocol::OK) {
+        iprint("flush of every extent hid a failed write back");
+        return 3;
+    }
+    std::vector<extent_protocol::op> ops(1);
+    std::vector<extent_protocol::op_result> results;
+    ops[0].proc = extent_protocol::getattr;
+    ops[0].id = g;
+    if (ec.compound(ops, results) == extent_protocol::OK) {
+        iprint("a compound call hid a failed write back");
+        return 4;
+    }
+
+    // the leases run out; the writes must not go with them
+    usleep((EXTENT_LEASE_MS + 200) * 1000);
+    ec.getattr(f, a);
+    if (a.size != data.size() || ec.read(g, 0, data.size(), got) != extent_protocol::OK
+        || got != data) {
+        iprint("the end of a lease dropped writes not written back");
+        return 5;
+    }
+
+    int unused;
+    es.remove(big, unused);
+    if (ec.flush() != extent_protocol::OK) {
+        iprint("flush failed with room on the disk");
+        return 6;
+    }
+    other.get(f, got);
+    if (got != data) {
+        iprint("the server lost the first written back extent");
+        return 7;
+    }
+    other.get(g, got);
+    if (got != data) {
+        iprint("the server lost the second written back extent");
+        return 8;
+    }
+    printf("[pass failed write back]\n");
+    return 0;
+}
+
+int main() {
+    extent_server es;
+    std::string port = start_extent_server(&es);
+    if (test_failed_write_back(es, port) != 0) {
+        return 1;
+    }
+    printf("[pass chfs client]\n");
+    return 0;
+}
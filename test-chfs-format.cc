@@ -0,0 +1,267 @@
+// Regression tests of the directory format: lookups, leaf splits and
+// chains, cookies, and a full disk. Each test checks the code against
+// a plain in-memory model.
+
+#include "directory.h"
+
+#include <stdlib.h>
+#include <stdio.h>
+
+#include <map>
+#include <set>
+#include <string>
+#include <vector>
+
+#define iprint(msg) \
+    printf("[TEST_ERROR]: %s\n", msg);
+
+// A directory file kept in a string.
+class string_dir_io : public directory::io {
+public:
+    std::string f;
+    extent_protocol::status read(uint32_t b, std::string &block) {
+        size_t off = (size_t)b * DIR_BLOCK;
+        block = off < f.size() ? f.substr(off, DIR_BLOCK) : "";
+        return extent_protocol::OK;
+    }
+    extent_protocol::status write(uint32_t b, const std::string &block) {
+        size_t off = (size_t)b * DIR_BLOCK;
+        if (f.size() < off + block.size())
+            f.resize(off + block.size(), '\0');
+        f.replace(off, block.size(), block);
+        return extent_protocol::OK;
+    }
+};
+
+// Every entry of dir, listed max at a time.
+int list_all(directory &dir, uint32_t max, std::vector<directory::entry> &entries) {
+    uint64_t cookie = 0;
+    while (true) {
+        size_t before = entries.size();
+        if (dir.list(cookie, max, entries) != extent_protocol::OK)
+            return 1;
+        if (entries.size() - before < max)
+            return 0;
+        cookie = entries.back().cookie;
+    }
+}
+
+int same_entries(directory &dir, const std::map<std::string, uint32_t> &model) {
+    std::vector<directory::entry> entries;
+    if (list_all(dir, 7, entries) != 0 || entries.size() != model.size())
+        return 1;
+    for (size_t i = 0; i < entries.size(); i++) {
+        std::map<std::string, uint32_t>::const_iterator it = model.find(entries[i].name);
+        if (it == model.end() || it->second != entries[i].inum)
+            return 1;
+    }
+    return 0;
+}
+
+std::string random_name(int i) {
+    // long names fill leaves quickly, so they split
+    return "f" + std::to_string(i) + std::string(rand() % 120, 'a' + rand() % 26);
+}
+
+int test_directory_model() {
+    string_dir_io io;
+    directory dir(&io);
+    std::map<std::string, uint32_t> model;
+
+    printf("========== begin test directory model ==========\n");
+    srand(1);
+    for (int i = 0; i < 100000; i++) {
+        std::string name = random_name(rand() % 5000);
+        uint32_t inum;
+        int op = rand() % 10;
+        int r;
+        if (op < 5) {
+            r = dir.add(name, i + 1);
+            if (r != (model.count(name) ? extent_protocol::EXIST : extent_protocol::OK)) {
+                iprint("add returned the wrong status");
+                return 1;
+            }
+            model.insert(std::make_pair(name, i + 1));
+        } else if (op < 8) {
+            r = dir.lookup(name, inum);
+            if (model.count(name) ? (r != extent_protocol::OK || inum != model[name])
+                                  : r != extent_protocol::NOENT) {
+                iprint("lookup disagrees with the model");
+                return 2;
+            }
+        } else {
+            r = dir.remove(name, inum);
+            if (model.count(name) ? (r != extent_protocol::OK || inum != model[name])
+                                  : r != extent_protocol::NOENT) {
+                iprint("remove disagrees with the model");
+                return 3;
+            }
+            model.erase(name);
+        }
+        if (i % 10000 == 0 && same_entries(dir, model) != 0) {
+            iprint("listing disagrees with the model");
+            return 4;
+        }
+    }
+    if (same_entries(dir, model) != 0) {
+        iprint("listing disagrees with the model");
+        return 4;
+    }
+    if (io.f.size() < 16 * DIR_BLOCK) {
+        iprint("directory never split");
+        return 5;
+    }
+    printf("[pass directory model] %lu names in %lu blocks\n",
+           model.size(), io.f.size() / DIR_BLOCK);
+    return 0;
+}
+
+// More names of one bucket than a leaf holds make a chain.
+int test_directory_chain() {
+    string_dir_io io;
+    directory dir(&io);
+    std::map<std::string, uint32_t> model;
+    uint32_t bucket = directory::hash("chain") % DIR_BUCKETS;
+
+    printf("========== begin test directory chain ==========\n");
+    for (int i = 0; model.size() < 3 * DIR_MAX_ENTRIES; i++) {
+        std::string name = "chain-" + std::to_string(i);
+        if (directory::hash(name) % DIR_BUCKETS != bucket)
+            continue;
+        if (dir.add(name, model.size() + 1) != extent_protocol::OK) {
+            iprint("add to a chain failed");
+            return 1;
+        }
+        model[name] = model.size() + 1;
+    }
+    for (std::map<std::string, uint32_t>::iterator it = model.begin(); it != model.end(); ++it) {
+        uint32_t inum;
+        if (dir.lookup(it->first, inum) != extent_protocol::OK || inum != it->second) {
+            iprint("lookup in a chain failed");
+            return 2;
+        }
+    }
+    if (same_entries(dir, model) != 0) {
+        iprint("listing of a chain disagrees with the model");
+        return 3;
+    }
+    printf("[pass directory chain]\n");
+    return 0;
+}
+
+// A listing resumed from a cookie sees every name that stays in the
+// directory once, while other names come and go and leaves split.
+int test_directory_cookies() {
+    string_dir_io io;
+    directory dir(&io);
+    std::set<std::string> stable, others;
+    std::map<std::string, int> seen;
+
+    printf("========== begin test directory cookies ==========\n");
+    srand(2);
+    for (int i = 0; i < 3000; i++) {
+        std::string name = random_name(i);
+        if (dir.add(name, i + 1) == extent_protocol::OK)
+            stable.insert(name);
+    }
+    uint64_t cookie = 0;
+    int next = 3000;
+    while (true) {
+        std::vector<directory::entry> entries;
+        if (dir.list(cookie, 10, entries) != extent_protocol::OK) {
+            iprint("list failed");
+            return 1;
+        }
+        for (size_t i = 0; i < entries.size(); i++)
+            seen[entries[i].name]++;
+        if (entries.size() < 10)
+            break;
+        cookie = entries.back().cookie;
+        for (int k = 0; k < 20; k++, next++) {
+            std::string name = random_name(next);
+            if (dir.add(name, next + 1) == extent_protocol::OK)
+                others.insert(name);
+        }
+        for (int k = 0; k < 10 && !others.empty(); k++) {
+            uint32_t inum;
+            dir.remove(*others.begin(), inum);
+            others.erase(others.begin());
+        }
+    }
+    for (std::map<std::string, int>::iterator it = seen.begin(); it != seen.end(); ++it) {
+        if (it->second != 1) {
+            iprint("a name was listed twice");
+            return 2;
+        }
+    }
+    for (std::set<std::string>::iterator it = stable.begin(); it != stable.end(); ++it) {
+        if (seen.find(*it) == seen.end()) {
+            iprint("a name was skipped");
+            return 3;
+        }
+    }
+    printf("[pass directory cookies] %lu names listed\n", seen.size());
+    return 0;
+}
+
+// A directory whose file cannot grow past limit blocks, like one on a
+// full disk.
+class full_dir_io : public string_dir_io {
+public:
+    uint32_t limit;
+    extent_protocol::status write(uint32_t b, const std::string &block) {
+        if (b >= limit)
+            return extent_protocol::IOERR;
+        return string_dir_io::write(b, block);
+    }
+};
+
+// An add that fails for want of space leaves every name in place.
+int test_directory_full() {
+    full_dir_io io;
+    directory dir(&io);
+    std::map<std::string, uint32_t> model;
+    int failed = 0;
+
+    printf("========== begin test directory full ==========\n");
+    io.limit = 8;
+    srand(3);
+    for (int i = 0; i < 3000; i++) {
+        std::string name = random_name(i);
+        int r = dir.add(name, i + 1);
+        if (r == extent_protocol::OK) {
+            model[name] = i + 1;
+        } else if (r == extent_protocol::IOERR) {
+            failed++;
+        } else {
+            iprint("add returned the wrong status");
+            return 1;
+        }
+        if (failed > 0 && i % 50 == 0 && same_entries(dir, model) != 0) {
+            iprint("a failed add lost names");
+            return 2;
+        }
+    }
+    for (std::map<std::string, uint32_t>::iterator it = model.begin(); it != model.end(); ++it) {
+        uint32_t inum;
+        if (dir.lookup(it->first, inum) != extent_protocol::OK || inum != it->second) {
+            iprint("a failed add lost names");
+            return 2;
+        }
+    }
+    if (failed == 0) {
+        iprint("the directory never filled up");
+        return 3;
+    }
+    printf("[pass directory full] %lu names, %d adds failed\n", model.size(), failed);
+    return 0;
+}
+
+int main() {
+    if (test_directory_model() != 0 || test_directory_chain() != 0
+        || test_directory_cookies() != 0 || test_directory_full() != 0) {
+        return 1;
+    }
+    printf("[pass chfs format]\n");
+    return 0;
+}
@@ -0,0 +1,505 @@
+// Regression tests of the inode layer. Each test checks the code
+// against a plain in-memory model.
+
+#include "inode_manager.h"
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <sys/wait.h>
+
+#include <iterator>
+#include <map>
+#include <set>
+#include <string>
+#include <vector>
+
+#define iprint(msg) \
+    printf("[TEST_ERROR]: %s\n", msg);
+
+std::string read_all(inode_manager &im, uint32_t inum) {
+    char *buf = NULL;
+    int size = 0;
+    im.read_file(inum, &buf, &size);
+    std::string data(buf ? buf : "", size);
+    free(buf);
+    return data;
+}
+
+uint32_t file_size(inode_manager &im, uint32_t inum) {
+    extent_protocol::attr a;
+    a.size = 0;
+    im.get_attr(inum, a);
+    return a.size;
+}
+
+// The largest file that still fits, to a block.
+uint32_t room(inode_manager &im, uint32_t inum, uint32_t block_size) {
+    uint32_t lo = 0, hi = DISK_SIZE;
+    while (hi - lo > block_size) {
+        uint32_t mid = lo + (hi - lo) / 2;
+        std::string data(mid, 'r');
+        if (im.write_file(inum, data.data(), mid) == extent_protocol::OK)
+            lo = mid;
+        else
+            hi = mid;
+        im.write_file(inum, "", 0);
+    }
+    return lo;
+}
+
+int test_write_range(uint32_t block_size) {
+    inode_manager im(NULL, disk_geometry(block_size));
+    uint32_t inum = im.alloc_inode(extent_protocol::T_FILE);
+    std::string model;
+
+    printf("========== begin test write range, %u byte blocks ==========\n", block_size);
+    srand(block_size);
+    for (int i = 0; i < 2000; i++) {
+        uint32_t off = rand() % (40 * block_size);
+        uint32_t len = rand() % (3 * block_size);
+        if (rand() % 3 == 0)
+            off -= off % block_size;       // block aligned
+        if (rand() % 3 == 0)
+            len -= len % block_size;
+        std::string data(len, 'a' + rand() % 26);
+        if (im.write_file_range(inum, off, data.data(), len) != extent_protocol::OK) {
+            iprint("write_file_range failed");
+            return 1;
+        }
+        if (len > 0 && model.size() < off + len)
+            model.resize(off + len, '\0');
+        model.replace(off < model.size() ? off : model.size(), len, data);
+        if (rand() % 50 == 0) {
+            model.resize(rand() % (10 * block_size), '\0');
+            im.write_file(inum, model.data(), model.size());
+        }
+        if (i % 100 == 0 && read_all(im, inum) != model) {
+            iprint("file disagrees with the model");
+            return 2;
+        }
+    }
+
+    // nothing written extends nothing
+    uint32_t size = file_size(im, inum);
+    if (im.write_file_range(inum, size + 100000, "", 0) != extent_protocol::OK
+        || file_size(im, inum) != size) {
+        iprint("a zero length write past the end changed the size");
+        return 3;
+    }
+    if (im.write_file_range(inum, UINT32_MAX - 10, "0123456789abcdef", 16) == extent_protocol::OK
+        || file_size(im, inum) != size) {
+        iprint("a write past the largest file succeeded");
+        return 4;
+    }
+
+    // a write the disk cannot hold leaves the file and the free space
+    uint32_t other = im.alloc_inode(extent_protocol::T_FILE);
+    im.write_file(inum, "", 0);
+    uint32_t fits = room(im, other, block_size);
+    std::string big(fits + 64 * block_size, 'b');
+    if (im.write_file_range(other, 0, big.data(), big.size()) != extent_protocol::IOERR
+        || file_size(im, other) != 0) {
+        iprint("a write larger than the disk did not fail cleanly");
+        return 5;
+    }
+    if (room(im, other, block_size) != fits) {
+        iprint("a failed write leaked blocks");
+        return 6;
+    }
+    printf("[pass write range %u]\n", block_size);
+    return 0;
+}
+
+// Bytes that differ from block to block, so a block read from the
+// wrong place shows.
+std::string pattern(uint32_t size, uint32_t block_size) {
+    std::string data(size, '\0');
+    for (uint32_t i = 0; i < size; i++)
+        data[i] = (char)(i / block_size * 7 + i % 13);
+    return data;
+}
+
+// Files that end on either side of the direct, single, double and
+// triple indirect boundaries read back as written, and shrinking
+// them frees their indirect blocks again.
+int test_indirect(uint32_t block_size) {
+    inode_manager im(NULL, disk_geometry(block_size));
+    uint32_t inum = im.alloc_inode(extent_protocol::T_FILE);
+    uint32_t n = block_size / sizeof(blockid_t);
+    uint32_t fits = room(im, inum, block_size);
+    uint32_t edges[] = {(uint32_t)NDIRECT, (uint32_t)NDIRECT + n, (uint32_t)NDIRECT + n + n * n};
+    std::vector<uint32_t> blocks;
+
+    printf("========== begin test indirect, %u byte blocks ==========\n", block_size);
+    for (uint32_t edge : edges) {
+        blocks.push_back(edge);
+        blocks.push_back(edge + 1);
+    }
+    for (size_t i = 0; i < blocks.size(); i++) {
+        uint32_t size = blocks[i] * block_size;
+        if (size > fits)
+            break;
+        std::string data = pattern(size, block_size);
+        if (im.write_file(inum, data.data(), size) != extent_protocol::OK
+            || read_all(im, inum) != data) {
+            iprint("a file across an indirect boundary read back wrong");
+            return 1;
+        }
+        // grow it a block at a time across the boundary, then cut it back
+        std::string more = pattern(size + 2 * block_size, block_size);
+        if (im.write_file_range(inum, size, more.data() + size, 2 * block_size)
+                != extent_protocol::OK
+            || read_all(im, inum) != more) {
+            iprint("a write across an indirect boundary read back wrong");
+            return 2;
+        }
+        im.write_file(inum, more.data(), size - block_size / 2);
+        if (read_all(im, inum) != data.substr(0, size - block_size / 2)) {
+            iprint("a truncate across an indirect boundary read back wrong");
+            return 3;
+        }
+    }
+    im.write_file(inum, "", 0);
+    if (room(im, inum, block_size) != fits) {
+        iprint("an emptied file kept indirect blocks");
+        return 4;
+    }
+    printf("[pass indirect %u]\n", block_size);
+    return 0;
+}
+
+// A new disk image in /tmp; the caller unlinks it.
+std::string temp_image() {
+    char path[] = "/tmp/test-chfs-inode-XXXXXX";
+    int fd = mkstemp(path);
+    if (fd >= 0)
+        close(fd);
+    return path;
+}
+
+// Allocate blocks until the disk is full; every block handed out must
+// be free in the model. Return how many there were, or -1.
+int alloc_all(block_manager *bm, std::vector<bool> &used) {
+    int count = 0;
+    blockid_t start;
+    uint32_t got;
+    while ((got = bm->alloc_blocks(100, &start)) > 0) {
+        for (uint32_t k = 0; k < got; k++) {
+            if (start + k < FILEBLOCK(bm->sb) || start + k >= bm->sb.nblocks
+                || used[start + k])
+                return -1;
+            used[start + k] = true;
+        }
+        count += got;
+    }
+    return count;
+}
+
+int test_block_bitmap(uint32_t block_size) {
+    std::string image = temp_image();
+    disk_geometry geo(block_size);
+    block_manager *bm = new block_manager(image.c_str(), geo);
+    std::vector<bool> used(bm->sb.nblocks, false);
+    int nfree = bm->sb.nblocks - FILEBLOCK(bm->sb);
+
+    printf("========== begin test block bitmap, %u byte blocks ==========\n", block_size);
+    srand(block_size + 1);
+    blockid_t start;
+    if (bm->alloc_blocks(100, &start) != 100) {
+        iprint("an empty disk did not give a contiguous run");
+        return 1;
+    }
+    for (uint32_t k = 0; k < 100; k++)
+        used[start + k] = true;
+    nfree -= 100;
+    for (int i = 0; i < 100; i++) {
+        uint32_t n = 1 + rand() % 40;
+        uint32_t got = bm->alloc_blocks(n, &start);
+        if (got == 0 || got > n) {
+            iprint("alloc_blocks returned a bad run");
+            return 2;
+        }
+        for (uint32_t k = 0; k < got; k++) {
+            if (start + k < FILEBLOCK(bm->sb) || used[start + k]) {
+                iprint("a block was handed out twice");
+                return 3;
+            }
+            used[start + k] = true;
+        }
+        nfree -= got;
+        // free a few blocks here and there, leaving holes
+        for (int k = 0; k < 10; k++) {
+            blockid_t id = FILEBLOCK(bm->sb) + rand() % (bm->sb.nblocks - FILEBLOCK(bm->sb));
+            if (used[id]) {
+                bm->free_block(id);
+                used[id] = false;
+                nfree++;
+            }
+        }
+        bm->end_op();
+    }
+    bm->flush();
+
+    // the bitmap survives a remount, and the freed blocks are reused
+    delete bm;
+    bm = new block_manager(image.c_str(), geo);
+    std::vector<bool> after = used;
+    if (alloc_all(bm, after) != nfree) {
+        iprint("the remounted bitmap disagrees with the model");
+        return 4;
+    }
+    if (bm->alloc_block() != 0) {
+        iprint("a full disk handed out a block");
+        return 5;
+    }
+    delete bm;
+    unlink(image.c_str());
+    printf("[pass block bitmap %u]\n", block_size);
+    return 0;
+}
+
+// Inums come lowest free first, freed ones are handed out again, and
+// the bitmap is rebuilt from the inode table at mount.
+int test_inode_bitmap() {
+    std::string image = temp_image();
+    disk_geometry geo(BLOCK_SIZE, DISK_SIZE, 256);
+    inode_manager *im = new inode_manager(image.c_str(), geo);
+    std::set<uint32_t> free_inums;
+
+    printf("========== begin test inode bitmap ==========\n");
+    for (uint32_t inum = 2; inum < geo.ninodes; inum++) {
+        if (im->alloc_inode(extent_protocol::T_FILE) != inum) {
+            iprint("alloc_inode skipped the lowest free inum");
+            return 1;
+        }
+    }
+    srand(4);
+    for (int i = 0; i < 40; i++) {
+        uint32_t inum = 2 + rand() % (geo.ninodes - 2);
+        im->free_inode(inum);
+        free_inums.insert(inum);
+    }
+    for (int i = 0; i < 10; i++) {
+        if (im->alloc_inode(extent_protocol::T_FILE) != *free_inums.begin()) {
+            iprint("alloc_inode did not reuse the lowest freed inum");
+            return 2;
+        }
+        free_inums.erase(free_inums.begin());
+    }
+    delete im;
+
+    // wipe the on-disk inode bitmap; the mount rebuilds it
+    block_manager *bm = new block_manager(image.c_str(), geo);
+    char zero[MAX_BLOCK_SIZE] = {};
+    for (uint32_t b = 0; b < IBMAP_BLOCKS(bm->sb); b++)
+        bm->write_block(IBMBLOCK(b * BPB(bm->sb), bm->sb), zero);
+    delete bm;
+    im = new inode_manager(image.c_str(), geo);
+    while (!free_inums.empty()) {
+        if (im->alloc_inode(extent_protocol::T_DIR) != *free_inums.begin()) {
+            iprint("the remounted inode bitmap disagrees with the model");
+            return 3;
+        }
+        free_inums.erase(free_inums.begin());
+    }
+
+    // with every inum in use, alloc_inode ends the process
+    fflush(stdout);
+    pid_t pid = fork();
+    if (pid == 0) {
+        im->alloc_inode(extent_protocol::T_FILE);
+        _exit(0);
+    }
+    int status;
+    waitpid(pid, &status, 0);
+    if (!WIFEXITED(status) || WEXITSTATUS(status) == 0) {
+        iprint("a full inode table handed out an inum");
+        return 4;
+    }
+    delete im;
+    unlink(image.c_str());
+    printf("[pass inode bitmap]\n");
+    return 0;
+}
+
+// More inodes than the inode cache holds keep their attributes and
+// contents through evictions and a remount.
+int test_inode_cache() {
+    std::string image = temp_image();
+    inode_manager *im = new inode_manager(image.c_str());
+    std::vector<uint32_t> inums;
+
+    printf("========== begin test inode cache ==========\n");
+    for (uint32_t i = 0; i < 3 * ICACHE_SIZE; i++) {
+        uint32_t inum = im->alloc_inode(i % 2 ? extent_protocol::T_DIR : extent_protocol::T_FILE);
+        std::string data = pattern(i * 37, BLOCK_SIZE);
+        im->write_file(inum, data.data(), data.size());
+        inums.push_back(inum);
+    }
+    for (int pass = 0; pass < 2; pass++) {
+        for (uint32_t i = 0; i < inums.size(); i++) {
+            extent_protocol::attr a;
+            a.type = 0;
+            im->get_attr(inums[i], a);
+            if (a.type != (i % 2 ? extent_protocol::T_DIR : extent_protocol::T_FILE)
+                || a.size != i * 37 || read_all(*im, inums[i]) != pattern(i * 37, BLOCK_SIZE)) {
+                iprint(pass == 0 ? "an evicted inode lost its changes"
+                                 : "a remounted inode lost its changes");
+                return pass + 1;
+            }
+        }
+        delete im;
+        im = new inode_manager(image.c_str());
+    }
+    delete im;
+    unlink(image.c_str());
+    printf("[pass inode cache]\n");
+    return 0;
+}
+
+// One step of a random workload; model follows what it does.
+void journal_step(inode_manager &im, std::map<uint32_t, std::string> &model, unsigned &seed) {
+    int op = rand_r(&seed) % 4;
+    if (op == 0 || model.empty()) {
+        model[im.alloc_inode(extent_protocol::T_FILE)] = "";
+        return;
+    }
+    std::map<uint32_t, std::string>::iterator it = model.begin();
+    std::advance(it, rand_r(&seed) % model.size());
+    if (op == 1) {
+        uint32_t off = rand_r(&seed) % 20000, len = rand_r(&seed) % 9000 + 1;
+        std::string data(len, 'a' + rand_r(&seed) % 26);
+        if (it->second.size() < off + len)
+            it->second.resize(off + len, '\0');
+        it->second.replace(off, len, data);
+        im.write_file_range(it->first, off, data.data(), len);
+    } else if (op == 2) {
+        std::string data(rand_r(&seed) % 30000, 'A' + rand_r(&seed) % 26);
+        it->second = data;
+        im.write_file(it->first, data.data(), data.size());
+    } else {
+        im.remove_file(it->first);
+        model.erase(it);
+    }
+}
+
+// A process dies without shutting down; the image holds the files of
+// the steps up to its log index (whole data blocks are written in
+// place, so their contents may be newer), and redoing the later steps
+// ends where a run that never crashed does, down to the free space.
+int test_journal_replay() {
+    std::string image = temp_image();
+
+    printf("========== begin test journal replay ==========\n");
+    for (int round = 0; round < 10; round++) {
+        int total = 40 + round * 13;
+        unlink(image.c_str());
+        fflush(stdout);
+        pid_t pid = fork();
+        if (pid == 0) {
+            inode_manager *im = new inode_manager(image.c_str());
+            std::map<uint32_t, std::string> model;
+            unsigned seed = round;
+            for (int i = 1; i <= total; i++) {
+                im->begin_op();
+                journal_step(*im, model, seed);
+                im->set_log_index(i);
+                im->end_op();
+            }
+            _exit(0);   // what is not committed yet is lost
+        }
+        int status;
+        waitpid(pid, &status, 0);
+
+        inode_manager im(image.c_str());
+        uint32_t applied = im.get_log_index();
+        inode_manager ref;
+        std::map<uint32_t, std::string> model;
+        unsigned seed = round;
+        for (uint32_t i = 1; i <= applied; i++)
+            journal_step(ref, model, seed);
+        for (uint32_t inum = 2; inum < INODE_NUM; inum++) {
+            extent_protocol::attr a;
+            a.type = 0;
+            im.get_attr(inum, a);
+            if ((a.type != 0) != (model.count(inum) > 0)
+                || (a.type != 0 && a.size != model[inum].size())) {
+                iprint("image disagrees with its log index");
+                return 1;
+            }
+        }
+        std::map<uint32_t, std::string> rest = model;
+        unsigned rest_seed = seed;
+        for (uint32_t i = applied + 1; i <= (uint32_t)total; i++) {
+            journal_step(im, rest, rest_seed);
+            journal_step(ref, model, seed);
+        }
+        for (std::map<uint32_t, std::string>::iterator it = model.begin(); it != model.end(); ++it) {
+            if (read_all(im, it->first) != it->second) {
+                iprint("redone steps disagree with the model");
+                return 2;
+            }
+        }
+        uint32_t inum = im.alloc_inode(extent_protocol::T_FILE);
+        if (room(im, inum, BLOCK_SIZE) != room(ref, ref.alloc_inode(extent_protocol::T_FILE), BLOCK_SIZE)) {
+            iprint("the image lost or leaked blocks");
+            return 3;
+        }
+    }
+    unlink(image.c_str());
+    printf("[pass journal replay]\n");
+    return 0;
+}
+
+
+// Blocks freed in an operation are not handed out again before their
+// commit, which only ever comes between operations, and a hole however
+// large stays out of the journal.
+int test_journal_room() {
+    std::string image = temp_image();
+    inode_manager *im = new inode_manager(image.c_str());
+    uint32_t inum = im->alloc_inode(extent_protocol::T_FILE);
+
+    printf("========== begin test journal room ==========\n");
+    uint32_t fits = room(*im, inum, BLOCK_SIZE);
+    std::string data(fits, 'j');
+    im->begin_op();
+    if (im->write_file(inum, data.data(), fits) != extent_protocol::OK) {
+        iprint("freed blocks were not committed before the next operation");
+        return 1;
+    }
+    im->write_file(inum, "", 0);
+    if (im->write_file(inum, data.data(), fits) == extent_protocol::OK) {
+        iprint("blocks freed in an operation were handed out in it");
+        return 2;
+    }
+    im->end_op();
+    if (im->write_file(inum, data.data(), fits) != extent_protocol::OK
+        || read_all(*im, inum) != data) {
+        iprint("freed blocks were not committed after the operation");
+        return 3;
+    }
+    im->write_file(inum, "", 0);
+    if (im->write_file_range(inum, fits - 1, "h", 1) != extent_protocol::OK
+        || read_all(*im, inum) != std::string(fits - 1, '\0') + "h") {
+        iprint("a write after a large hole failed");
+        return 4;
+    }
+    delete im;
+    unlink(image.c_str());
+    printf("[pass journal room]\n");
+    return 0;
+}
+
+int main() {
+    if (test_block_bitmap(MIN_BLOCK_SIZE) != 0 || test_block_bitmap(MAX_BLOCK_SIZE) != 0
+        || test_inode_bitmap() != 0 || test_inode_cache() != 0
+        || test_journal_replay() != 0 || test_journal_room() != 0
+        || test_indirect(MIN_BLOCK_SIZE) != 0 || test_indirect(MAX_BLOCK_SIZE) != 0
+        || test_write_range(MIN_BLOCK_SIZE) != 0 || test_write_range(MAX_BLOCK_SIZE) != 0) {
+        return 1;
+    }
+    printf("[pass chfs inode]\n");
+    return 0;
+}
@@ -119,6 +119,14 @@ int main(int argc, char *argv[]) {
     server.reg(extent_protocol::put, es_rg, &extent_server_dist::put);
     server.reg(extent_protocol::remove, es_rg, &extent_server_dist::remove);
     server.reg(extent_protocol::create, es_rg, &extent_server_dist::create);
+    server.reg(extent_protocol::read, es_rg, &extent_server_dist::read);
+    server.reg(extent_protocol::write, es_rg, &extent_server_dist::write);
+    server.reg(extent_protocol::lookup, es_rg, &extent_server_dist::lookup);
+    server.reg(extent_protocol::add_entry, es_rg, &extent_server_dist::add_entry);
+    server.reg(extent_protocol::remove_entry, es_rg, &extent_server_dist::remove_entry);
+    server.reg(extent_protocol::create_entry, es_rg, &extent_server_dist::create_entry);
+    server.reg(extent_protocol::compound, es_rg, &extent_server_dist::compound);
+    server.reg(extent_protocol::readdir, es_rg, &extent_server_dist::readdir);
 
     chfs_c = new chfs_client(extent_port);
 